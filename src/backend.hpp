@@ -0,0 +1,110 @@
+#ifndef XRA_BACKEND_HPP
+#define XRA_BACKEND_HPP
+
+namespace llvm {
+class TargetMachine;
+class TargetOptions;
+}
+
+namespace xra {
+
+struct BackendOptions
+{
+  BackendOptions() :
+    optLevel(0),
+    lazyJIT(false),
+    tiered(false),
+    tierThreshold(10000),
+    cacheLimit(256 << 20),
+    fastMath(false),
+    specializeBudget(1000),
+    constEval(true)
+  {}
+
+  unsigned int optLevel;
+  string cpu; // "native" for the host, empty for the generic target
+  string features; // comma separated, e.g. "+avx2,-fma"
+  bool lazyJIT;
+  bool tiered;
+  unsigned int tierThreshold; // calls plus loop iterations before a function is reoptimized
+  string cacheDir; // empty disables the object cache
+  size_t cacheLimit; // bytes
+  bool fastMath; // float math may be reassociated and fused, and assumed finite
+  size_t specializeBudget; // instructions cloned for constant arguments at -O2 and above
+  bool constEval; // evaluate pure top-level constants while compiling
+};
+
+// optimizer.cpp
+void Optimize(llvm::Module&, const BackendOptions&);
+
+// consteval.cpp
+void FoldConstants(llvm::Module&, const vector<llvm::Function*>& helpers, const BackendOptions&);
+
+// specialize.cpp
+void Specialize(llvm::Module&, size_t budget);
+
+// native.cpp
+llvm::CodeGenOpt::Level GetCodeGenOptLevel(const BackendOptions&);
+string GetTargetCPU(const BackendOptions&);
+vector<string> GetTargetFeatures(const BackendOptions&);
+llvm::TargetOptions GetTargetOptions(const BackendOptions&);
+unique_ptr<llvm::TargetMachine> CreateTargetMachine(const BackendOptions&, string& err);
+bool EmitObjectFile(llvm::Module&, const string& path, const BackendOptions&, string& err);
+llvm::Function* CreateEntryPoint(llvm::Module&, llvm::Function& xraMain);
+bool LinkExecutable(const string& objectPath, const string& outputPath, string& err);
+bool LinkSharedObject(const string& objectPath, const string& outputPath, string& err);
+
+// jit.cpp
+unique_ptr<llvm::ExecutionEngine> CreateJIT(llvm::Module*, const BackendOptions&, string& err);
+
+// tiering.cpp
+class Tiering
+{
+public:
+  // instruments every function but entry; must run before the module is JITed
+  Tiering(llvm::Module& module, llvm::Function& entry, const BackendOptions& options);
+  ~Tiering();
+
+  // starts the background compiler once the baseline engine exists
+  void Start(llvm::ExecutionEngine& engine);
+
+private:
+  struct Function
+  {
+    string name;
+    llvm::GlobalVariable* slot;
+    void** slotAddress;
+    bool queued;
+  };
+
+  static void Hot(int32_t id);
+  void Run();
+  bool CreateOptimizedEngine();
+  void Recompile(Function& function);
+
+  BackendOptions options;
+  string bitcode;
+  llvm::Function* hook;
+  vector<Function> functions;
+  vector<llvm::GlobalVariable*> sharedGlobals;
+  vector<void*> sharedAddresses; // the baseline engine's, by index into sharedGlobals
+
+  // only touched by the worker thread
+  unique_ptr<llvm::LLVMContext> optimizedContext;
+  unique_ptr<llvm::ExecutionEngine> optimizedEngine;
+  llvm::Module* optimizedModule;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  deque<int32_t> queue;
+  bool stopping;
+};
+
+// cache.cpp
+string HashModule(const llvm::Module&, const BackendOptions&);
+void* LoadCachedFunction(const llvm::Module&, const string& name, const BackendOptions&, bool& hit, string& err);
+
+} // namespace xra
+
+#endif // XRA_BACKEND_HPP
@@ -1,9 +1,123 @@
 #include "common.hpp"
 #include "typechecker.hpp"
 #include "compiler.hpp"
+#include <llvm/Intrinsics.h>
+#include <llvm/Analysis/Verifier.h>
 
 namespace xra {
 
+// operations an #if may evaluate unconditionally to avoid a branch
+static const int SpeculationBudget = 4;
+
+static bool CanSpeculate(const Expr& expr, int& budget)
+{
+  switch(expr.kind) {
+  case Base::Kind_EBoolean:
+  case Base::Kind_EInteger:
+  case Base::Kind_EFloat:
+  case Base::Kind_EString:
+    return true;
+  case Base::Kind_EVariable:
+    return --budget >= 0;
+  case Base::Kind_EList:
+    for(auto& e : static_cast<const EList&>(expr).exprs) {
+      if(!CanSpeculate(*e, budget))
+        return false;
+    }
+    return true;
+  case Base::Kind_ECall: {
+    auto& call = static_cast<const ECall&>(expr);
+    auto builtin = dyn_cast<VBuiltin>(call.function->value.get());
+    return builtin && builtin->CanSpeculate(static_cast<EList&>(*call.argument).exprs, budget);
+  }
+  default:
+    return false;
+  }
+}
+
+// the arguments of a call to the builtin bound to name, or null
+static const vector<ExprPtr>* BuiltinArgs(const Expr& expr, const char* name)
+{
+  auto call = dyn_cast<ECall>(&expr);
+  if(!call)
+    return nullptr;
+
+  auto callee = dyn_cast<EVariable>(call->function.get());
+  if(!callee || callee->name != name || !isa<VBuiltin>(callee->value.get()))
+    return nullptr;
+
+  return &static_cast<const EList&>(*call->argument).exprs;
+}
+
+// strings are {data, length} pairs
+static llvm::Value* CreateStringData(Compiler& compiler, llvm::Value* str)
+{
+  return compiler.builder.CreateExtractValue(str, 0, "data");
+}
+
+static llvm::Value* CreateStringLength(Compiler& compiler, llvm::Value* str)
+{
+  return compiler.builder.CreateExtractValue(str, 1, "len");
+}
+
+// declares a runtime function taking the data and length of each of its string operands
+static llvm::Constant* GetStringRuntime(Compiler& compiler, const char* name, llvm::Type* result, unsigned int operands)
+{
+  auto& builder = compiler.builder;
+  vector<llvm::Type*> params;
+  for(unsigned int i = 0; i < operands; i++) {
+    params.push_back(builder.getInt8PtrTy());
+    params.push_back(builder.getInt64Ty());
+  }
+  return compiler.module.getOrInsertFunction(name, llvm::FunctionType::get(result, params, false));
+}
+
+static llvm::Value* CreateMemoryCompare(Compiler& compiler, llvm::Value* left, llvm::Value* right, llvm::Value* length)
+{
+  auto& builder = compiler.builder;
+  vector<llvm::Type*> params{builder.getInt8PtrTy(), builder.getInt8PtrTy(), builder.getInt64Ty()};
+  auto type = llvm::FunctionType::get(builder.getInt32Ty(), params, false);
+  vector<llvm::Value*> args{left, right, length};
+  return builder.CreateCall(compiler.module.getOrInsertFunction("memcmp", type), args, "memcmp");
+}
+
+// strings of different lengths differ without a look at their data
+static llvm::Value* CreateStringEquals(Compiler& compiler, llvm::Value* left, llvm::Value* right)
+{
+  auto& builder = compiler.builder;
+  auto& ctx = compiler.module.getContext();
+  auto func = builder.GetInsertBlock()->getParent();
+
+  auto length = CreateStringLength(compiler, left);
+  auto sameLength = builder.CreateICmpEQ(length, CreateStringLength(compiler, right));
+
+  auto entryBlock = builder.GetInsertBlock();
+  auto compareBlock = llvm::BasicBlock::Create(ctx, "strcmp", func);
+  auto endBlock = llvm::BasicBlock::Create(ctx, "endstrcmp", func);
+  builder.CreateCondBr(sameLength, compareBlock, endBlock);
+
+  builder.SetInsertPoint(compareBlock);
+  auto compare = CreateMemoryCompare(compiler, CreateStringData(compiler, left), CreateStringData(compiler, right), length);
+  auto sameData = builder.CreateICmpEQ(compare, builder.getInt32(0));
+  builder.CreateBr(endBlock);
+
+  builder.SetInsertPoint(endBlock);
+  auto phi = builder.CreatePHI(builder.getInt1Ty(), 2, "streq");
+  phi->addIncoming(builder.getFalse(), entryBlock);
+  phi->addIncoming(sameData, compareBlock);
+  return phi;
+}
+
+// orders strings bytewise, a proper prefix first
+static llvm::Value* CreateStringCompare(Compiler& compiler, llvm::Value* left, llvm::Value* right)
+{
+  auto& builder = compiler.builder;
+  auto compare = GetStringRuntime(compiler, "xra_string_compare", builder.getInt32Ty(), 2);
+  vector<llvm::Value*> args{CreateStringData(compiler, left), CreateStringLength(compiler, left),
+                            CreateStringData(compiler, right), CreateStringLength(compiler, right)};
+  return builder.CreateCall(compare, args, "strcmp");
+}
+
 /*
  * BSequence
  */
@@ -13,30 +127,42 @@ class BSequence : public VBuiltin
 public:
   ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
   void Compile(Compiler&, const vector<ExprPtr>&);
+  bool IsPure() const { return true; }
 };
 
 ValuePtr BSequence::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
 {
+  bool failed = false;
   for(auto& e : args)
   {
     TypeSubst lastSubst;
     checker.subst.swap(lastSubst);
 
     checker.Visit(e.get());
-    if(!e->value)
+    if(Diagnostics::Current().Aborted())
       return {};
 
+    // a statement that fails is skipped so the ones after it are still
+    // checked, up to the error limit
+    if(!e->value) {
+      failed = true;
+      checker.subst.swap(lastSubst);
+      continue;
+    }
+
     Compose(lastSubst, checker.subst);
   }
 
-  return args.back()->value;
+  return failed ? ValuePtr() : args.back()->value;
 }
 
 void BSequence::Compile(Compiler& compiler, const vector<ExprPtr>& args)
 {
-  for(auto& e : args) {
+  bool tail = compiler.tailPosition;
+
+  for(size_t i = 0; i < args.size(); i++) {
     compiler.result = nullptr;
-    compiler.Visit(e.get());
+    compiler.Visit(args[i].get(), tail && i == args.size() - 1);
   }
 }
 
@@ -49,6 +175,7 @@ class BAssign : public VBuiltin
 public:
   ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
   void Compile(Compiler&, const vector<ExprPtr>&);
+  bool IsPure() const { return true; }
 };
 
 ValuePtr BAssign::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
@@ -58,6 +185,21 @@ ValuePtr BAssign::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
   auto& left = args[0];
   auto& right = args[1];
 
+  // if the left side is a plain variable not in the environment, create a fresh local
+  ValuePtr fresh;
+  if(isa<EVariable>(left.get()))
+  {
+    auto& name = static_cast<EVariable&>(*left).name;
+    if(!checker.env[name]) {
+      fresh = new VLocal(checker.functions.empty() ? nullptr : checker.functions.back());
+      fresh->type = MakeTypeVar();
+    }
+  }
+
+  // a function may refer to the name it is being bound to
+  if(fresh && isa<EFunction>(Unannotated(right.get())))
+    checker.env.AddValue(static_cast<EVariable&>(*left).name, fresh);
+
   checker.Visit(right.get());
   if(!right->value)
     return {};
@@ -65,15 +207,10 @@ ValuePtr BAssign::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
   TypeSubst rightSubst;
   checker.subst.swap(rightSubst);
 
-  // if the left side is a plain variable not in the environment, create a fresh local
-  if(isa<EVariable>(left.get()))
-  {
-    auto& name = static_cast<EVariable&>(*left).name;
-    if(!checker.env[name]) {
-      left->value = new VLocal;
-      left->value->type = MakeTypeVar();
-      checker.env.AddValue(name, left->value);
-    }
+  if(fresh) {
+    left->value = fresh;
+    if(!isa<EFunction>(Unannotated(right.get())))
+      checker.env.AddValue(static_cast<EVariable&>(*left).name, fresh);
   }
 
   if(!left->value)
@@ -85,17 +222,37 @@ ValuePtr BAssign::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
 
   Compose(rightSubst, checker.subst);
 
-  auto unifySubst = Unify(*left->value->type, *right->value->type);
-  left->value->type = xra::Apply(unifySubst, *left->value->type);
+  auto leftType = xra::Apply(checker.subst, *left->value->type);
+  auto rightType = xra::Apply(checker.subst, *right->value->type);
+  auto unifySubst = Unify(*leftType, *rightType);
+  left->value->type = xra::Apply(unifySubst, *leftType);
   Compose(unifySubst, checker.subst);
 
   return left->value;
 }
 
+// the types FoldConstants can turn back into LLVM constants
+static bool IsScalar(const Type& type)
+{
+  return isa<TBoolean>(&type) || isa<TInteger>(&type) || isa<TFloat>(&type);
+}
+
 void BAssign::Compile(Compiler& compiler, const vector<ExprPtr>& args)
 {
   assert(args.size() == 2);
 
+  // a top-level constant is computed at compile time and never stored
+  auto local = dyn_cast_or_null<VLocal>(args[0]->value.get());
+  if(compiler.foldConstants && local && local->assignedOnce &&
+     local->owner == compiler.topLevelFunction && compiler.function == local->owner &&
+     isa<EVariable>(args[0].get()) && IsScalar(*args[1]->value->type) && compiler.IsPure(*args[1])) {
+    compiler.result = compiler.CreateConstant(*local, *args[1]);
+    return;
+  }
+
+  if(isa<EVariable>(args[0].get()) && isa<EFunction>(Unannotated(args[1].get())))
+    compiler.bindingName = static_cast<EVariable&>(*args[0]).name;
+
   compiler.Visit(args[1].get());
   if(!compiler.result)
     return;
@@ -119,6 +276,7 @@ class BIf : public VBuiltin
 public:
   ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
   void Compile(Compiler&, const vector<ExprPtr>&);
+  bool IsPure() const { return true; }
 };
 
 ValuePtr BIf::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
@@ -165,21 +323,230 @@ ValuePtr BIf::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
   return value;
 }
 
+// an #if chain comparing one variable against this many constants is
+// dispatched with a switch instead of a compare per clause
+static const size_t DispatchThreshold = 3;
+
+// the constant of a condition of the form `x == constant`, or null; every
+// condition of a dispatchable chain must compare the same subject against
+// constants of the same kind as the first
+static const Expr* CaseConstant(const Expr& cond, const Expr*& subject, const Expr* first)
+{
+  auto operands = BuiltinArgs(cond, "==");
+  if(!operands || operands->size() != 2)
+    return nullptr;
+
+  const Expr* variable = (*operands)[0].get();
+  const Expr* constant = (*operands)[1].get();
+  if(!isa<EVariable>(variable))
+    swap(variable, constant);
+  if(!isa<EVariable>(variable) || !(isa<EInteger>(constant) || isa<EString>(constant)))
+    return nullptr;
+
+  if(subject && subject->value.get() != variable->value.get())
+    return nullptr;
+  if(first && first->kind != constant->kind)
+    return nullptr;
+  if(!subject)
+    subject = variable;
+  return constant;
+}
+
+// dispatch key of a string: its length and its first and last bytes
+static uint64_t StringKey(const string& str)
+{
+  uint64_t length = str.size();
+  uint64_t first = length ? (unsigned char)str.front() : 0;
+  uint64_t last = length ? (unsigned char)str.back() : 0;
+  return length << 16 | first << 8 | last;
+}
+
+static llvm::Value* CreateStringKey(Compiler& compiler, llvm::Value* str)
+{
+  auto& builder = compiler.builder;
+  auto& ctx = compiler.module.getContext();
+  auto func = builder.GetInsertBlock()->getParent();
+  auto int64 = builder.getInt64Ty();
+
+  // an empty string may point one past its buffer, so its bytes are not read
+  auto data = CreateStringData(compiler, str);
+  auto length = CreateStringLength(compiler, str);
+  auto emptyBlock = builder.GetInsertBlock();
+  auto bytesBlock = llvm::BasicBlock::Create(ctx, "keybytes", func);
+  auto keyBlock = llvm::BasicBlock::Create(ctx, "key", func);
+  builder.CreateCondBr(builder.CreateICmpEQ(length, builder.getInt64(0)), keyBlock, bytesBlock);
+
+  builder.SetInsertPoint(bytesBlock);
+  auto lastIndex = builder.CreateSub(length, builder.getInt64(1));
+  auto first = builder.CreateZExt(builder.CreateLoad(data), int64);
+  auto last = builder.CreateZExt(builder.CreateLoad(builder.CreateGEP(data, lastIndex)), int64);
+  auto bytes = builder.CreateOr(builder.CreateShl(first, 8), last);
+  builder.CreateBr(keyBlock);
+
+  builder.SetInsertPoint(keyBlock);
+  auto phi = builder.CreatePHI(int64, 2, "keybytes");
+  phi->addIncoming(builder.getInt64(0), emptyBlock);
+  phi->addIncoming(bytes, bytesBlock);
+  return builder.CreateOr(builder.CreateShl(length, 16), phi, "key");
+}
+
+// branches to the clause of the first case equal to the subject, or to otherwise
+static void CreateDispatch(Compiler& compiler, const Expr& subject, const vector<const Expr*>& cases,
+                           const vector<llvm::BasicBlock*>& clauses, llvm::BasicBlock* otherwise)
+{
+  auto& builder = compiler.builder;
+  auto& ctx = compiler.module.getContext();
+  auto func = builder.GetInsertBlock()->getParent();
+
+  compiler.Visit(&subject);
+  auto value = compiler.Load(compiler.result);
+  compiler.result = nullptr;
+
+  if(isa<EInteger>(cases[0])) {
+    auto type = llvm::cast<llvm::IntegerType>(value->getType());
+    auto inst = builder.CreateSwitch(value, otherwise, (unsigned int)cases.size());
+
+    // a repeated constant can never reach its later clause
+    set<llvm::ConstantInt*> seen;
+    for(size_t i = 0; i < cases.size(); i++) {
+      auto constant = llvm::ConstantInt::get(type, static_cast<const EInteger*>(cases[i])->literal);
+      if(seen.insert(constant).second)
+        inst->addCase(constant, clauses[i]);
+    }
+    return;
+  }
+
+  // strings are switched on a cheap key and then confirmed with a memcmp
+  map<uint64_t, vector<size_t>> buckets;
+  set<string> seen;
+  for(size_t i = 0; i < cases.size(); i++) {
+    auto& literal = static_cast<const EString*>(cases[i])->literal;
+    if(seen.insert(literal).second)
+      buckets[StringKey(literal)].push_back(i);
+  }
+
+  // a bucket's strings share their length, so the data is compared directly
+  auto data = CreateStringData(compiler, value);
+  auto inst = builder.CreateSwitch(CreateStringKey(compiler, value), otherwise, (unsigned int)buckets.size());
+  for(auto& bucket : buckets) {
+    auto block = llvm::BasicBlock::Create(ctx, "strcase", func);
+    inst->addCase(builder.getInt64(bucket.first), block);
+    builder.SetInsertPoint(block);
+
+    for(size_t n = 0; n < bucket.second.size(); n++) {
+      size_t i = bucket.second[n];
+      auto& literal = static_cast<const EString*>(cases[i])->literal;
+      auto next = (n + 1 < bucket.second.size()) ? llvm::BasicBlock::Create(ctx, "strcase", func) : otherwise;
+
+      auto pointer = builder.CreateGlobalStringPtr(literal, "EString");
+      auto compare = CreateMemoryCompare(compiler, data, pointer, builder.getInt64(literal.size()));
+      builder.CreateCondBr(builder.CreateICmpEQ(compare, builder.getInt32(0)), clauses[i], next);
+      builder.SetInsertPoint(next);
+    }
+  }
+}
+
 void BIf::Compile(Compiler& compiler, const vector<ExprPtr>& args)
 {
   assert(args.size() >= 2 && args.size() % 2 == 0);
 
+  bool tail = compiler.tailPosition;
   const size_t nclauses = args.size() / 2;
   auto& builder = compiler.builder;
   auto& ctx = compiler.module.getContext();
   auto func = builder.GetInsertBlock()->getParent();
 
-  llvm::AllocaInst* alloc = nullptr;
-  if(args.size() > 2)
-    alloc = builder.CreateAlloca(ToLLVM(*args[1]->value->type, ctx), nullptr, "iftmp");
+  // the result is merged with a phi in the endif block rather than through a stack slot
+  llvm::Type* type = nullptr;
+  if(args.size() > 2) {
+    type = ToLLVM(*args[1]->value->type, ctx);
+    if(type->isVoidTy())
+      type = nullptr;
+  }
+
+  // the leading conditions comparing one variable against constants
+  const Expr* subject = nullptr;
+  vector<const Expr*> cases;
+  auto lastCond = dyn_cast<EBoolean>(args[args.size() - 2].get());
+  size_t ncases = (lastCond && lastCond->literal) ? nclauses - 1 : nclauses;
+  for(size_t i = 0; i < ncases; i++) {
+    auto constant = CaseConstant(*args[i * 2], subject, cases.empty() ? nullptr : cases[0]);
+    if(!constant)
+      break;
+    cases.push_back(constant);
+  }
+  bool dispatch = cases.size() >= DispatchThreshold;
+
+  // an if/else whose later conditions and clauses are all cheap and free of
+  // side effects evaluates everything and picks the result with selects
+  if(type && lastCond && lastCond->literal && !dispatch) {
+    int budget = SpeculationBudget;
+    bool speculate = true;
+    for(size_t i = 1; i < args.size() - 2 && speculate; i++)
+      speculate = xra::CanSpeculate(*args[i], budget);
+    speculate = speculate && xra::CanSpeculate(*args.back(), budget);
+
+    if(speculate) {
+      vector<llvm::Value*> conds;
+      vector<llvm::Value*> values;
+      for(size_t i = 0; i < nclauses; i++) {
+        if(i < nclauses - 1) {
+          compiler.Visit(args[i * 2].get());
+          conds.push_back(compiler.Load(compiler.result));
+        }
+        compiler.Visit(args[i * 2 + 1].get());
+        auto value = compiler.Load(compiler.result);
+        values.push_back(value ? value : llvm::UndefValue::get(type));
+      }
+
+      auto value = values.back();
+      for(size_t i = nclauses - 1; i-- > 0;)
+        value = builder.CreateSelect(conds[i], values[i], value, "iftmp");
+      compiler.result = value;
+      return;
+    }
+  }
+
+  vector<pair<llvm::Value*, llvm::BasicBlock*>> incoming;
+
   auto endifBlock = llvm::BasicBlock::Create(ctx, "endif");
 
-  for(size_t i = 0; i < nclauses; i++)
+  auto clause = [&](size_t i, llvm::BasicBlock* thenBlock) {
+    builder.SetInsertPoint(thenBlock);
+    compiler.Visit(args[i * 2 + 1].get(), tail);
+    if(type) {
+      auto value = compiler.Load(compiler.result);
+      if(!value)
+        value = llvm::UndefValue::get(type);
+      incoming.push_back({value, builder.GetInsertBlock()});
+    }
+    compiler.result = nullptr;
+    builder.CreateBr(endifBlock);
+  };
+
+  size_t first = 0;
+  if(dispatch) {
+    vector<llvm::BasicBlock*> caseBlocks;
+    for(size_t i = 0; i < cases.size(); i++)
+      caseBlocks.push_back(llvm::BasicBlock::Create(ctx, "case", func));
+    auto elseBlock = llvm::BasicBlock::Create(ctx, "else", func);
+
+    CreateDispatch(compiler, *subject, cases, caseBlocks, elseBlock);
+    for(size_t i = 0; i < cases.size(); i++)
+      clause(i, caseBlocks[i]);
+
+    // the rest of the chain, if any, is compared as usual
+    builder.SetInsertPoint(elseBlock);
+    first = cases.size();
+    if(first == nclauses) {
+      if(type)
+        incoming.push_back({llvm::UndefValue::get(type), elseBlock});
+      builder.CreateBr(endifBlock);
+      builder.SetInsertPoint(endifBlock);
+    }
+  }
+
+  for(size_t i = first; i < nclauses; i++)
   {
     auto thenBlock = llvm::BasicBlock::Create(ctx, "then", func);
     auto contBlock = (i < nclauses - 1) ? llvm::BasicBlock::Create(ctx, "else", func) : endifBlock;
@@ -190,13 +557,12 @@ void BIf::Compile(Compiler& compiler, const vector<ExprPtr>& args)
     builder.CreateCondBr(compiler.result, thenBlock, contBlock);
     compiler.result = nullptr;
 
+    // no clause taken
+    if(type && contBlock == endifBlock)
+      incoming.push_back({llvm::UndefValue::get(type), builder.GetInsertBlock()});
+
     // then
-    builder.SetInsertPoint(thenBlock);
-    compiler.Visit(args[i * 2 + 1].get());
-    if(alloc)
-      builder.CreateStore(compiler.Load(compiler.result), alloc);
-    compiler.result = nullptr;
-    builder.CreateBr(endifBlock);
+    clause(i, thenBlock);
 
     // else or endif
     builder.SetInsertPoint(contBlock);
@@ -204,8 +570,99 @@ void BIf::Compile(Compiler& compiler, const vector<ExprPtr>& args)
 
   func->getBasicBlockList().push_back(endifBlock);
 
-  if(alloc)
-    compiler.result = builder.CreateLoad(alloc);
+  if(type) {
+    auto phi = builder.CreatePHI(type, (unsigned int)incoming.size(), "iftmp");
+    for(auto& in : incoming)
+      phi->addIncoming(in.first, in.second);
+    compiler.result = phi;
+  }
+}
+
+/*
+ * BLogical
+ */
+
+template<bool isAnd>
+class BLogical : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+  bool CanSpeculate(const vector<ExprPtr>&, int& budget);
+  bool IsPure() const { return true; }
+};
+
+template<bool isAnd>
+ValuePtr BLogical<isAnd>::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 2);
+
+  for(auto& arg : args) {
+    TypeSubst lastSubst;
+    checker.subst.swap(lastSubst);
+
+    checker.Visit(arg.get());
+    if(!arg->value)
+      return {};
+
+    Compose(lastSubst, checker.subst);
+    Compose(Unify(*arg->value->type, *BooleanType), checker.subst);
+  }
+
+  ValuePtr value = new VTemporary;
+  value->type = BooleanType;
+  return value;
+}
+
+template<bool isAnd>
+void BLogical<isAnd>::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 2);
+
+  auto& builder = compiler.builder;
+  auto& ctx = compiler.module.getContext();
+  auto func = builder.GetInsertBlock()->getParent();
+
+  compiler.Visit(args[0].get());
+  auto left = compiler.Load(compiler.result);
+
+  // a right side that is cheap and has no side effects needs no branch
+  int budget = SpeculationBudget;
+  if(xra::CanSpeculate(*args[1], budget)) {
+    compiler.Visit(args[1].get());
+    auto right = compiler.Load(compiler.result);
+    compiler.result = isAnd ? builder.CreateAnd(left, right) : builder.CreateOr(left, right);
+    return;
+  }
+
+  auto leftBlock = builder.GetInsertBlock();
+  auto rightBlock = llvm::BasicBlock::Create(ctx, isAnd ? "and.rhs" : "or.rhs", func);
+  auto endBlock = llvm::BasicBlock::Create(ctx, isAnd ? "and.end" : "or.end");
+
+  if(isAnd)
+    builder.CreateCondBr(left, rightBlock, endBlock);
+  else
+    builder.CreateCondBr(left, endBlock, rightBlock);
+
+  builder.SetInsertPoint(rightBlock);
+  compiler.Visit(args[1].get());
+  auto right = compiler.Load(compiler.result);
+  rightBlock = builder.GetInsertBlock();
+  builder.CreateBr(endBlock);
+
+  func->getBasicBlockList().push_back(endBlock);
+  builder.SetInsertPoint(endBlock);
+
+  auto phi = builder.CreatePHI(builder.getInt1Ty(), 2, isAnd ? "andtmp" : "ortmp");
+  phi->addIncoming(isAnd ? builder.getFalse() : builder.getTrue(), leftBlock);
+  phi->addIncoming(right, rightBlock);
+  compiler.result = phi;
+}
+
+template<bool isAnd>
+bool BLogical<isAnd>::CanSpeculate(const vector<ExprPtr>& args, int& budget)
+{
+  return --budget >= 0 && xra::CanSpeculate(*args[0], budget) && xra::CanSpeculate(*args[1], budget);
 }
 
 /*
@@ -216,6 +673,7 @@ class BWhile : public VBuiltin
 {
   ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
   void Compile(Compiler&, const vector<ExprPtr>&);
+  bool IsPure() const { return true; }
 };
 
 ValuePtr BWhile::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
@@ -256,14 +714,16 @@ void BWhile::Compile(Compiler& compiler, const vector<ExprPtr>& args)
   auto condBlock = llvm::BasicBlock::Create(ctx, "while", func);
   auto doBlock = llvm::BasicBlock::Create(ctx, "do", func);
   auto lastEndLoopBlock = compiler.endLoopBlock;
+  auto lastLoopRegionDepth = compiler.loopRegionDepth;
   compiler.endLoopBlock = llvm::BasicBlock::Create(ctx, "endwhile");
+  compiler.loopRegionDepth = compiler.regionDepth;
 
   builder.CreateBr(condBlock);
 
   // while
   builder.SetInsertPoint(condBlock);
   compiler.Visit(args[0].get());
-  builder.CreateCondBr(compiler.result, doBlock, compiler.endLoopBlock);
+  builder.CreateCondBr(compiler.Load(compiler.result), doBlock, compiler.endLoopBlock);
   compiler.result = nullptr;
 
   // do
@@ -276,250 +736,1568 @@ void BWhile::Compile(Compiler& compiler, const vector<ExprPtr>& args)
   func->getBasicBlockList().push_back(compiler.endLoopBlock);
   builder.SetInsertPoint(compiler.endLoopBlock);
   compiler.endLoopBlock = lastEndLoopBlock;
+  compiler.loopRegionDepth = lastLoopRegionDepth;
 }
 
 /*
- * BReturn
+ * BFor
+ *
+ * for i in from..to [by step] runs the body for i = from, from + step, ...
+ * while i < to. The trip count is computed up front and the loop counts an
+ * index up to it in a single phi, with the test at the bottom: the form the
+ * vectorizer and unroller recognize. A step that is not positive runs no
+ * iterations.
  */
 
-class BReturn : public VBuiltin
+class BFor : public VBuiltin
 {
 public:
   ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
   void Compile(Compiler&, const vector<ExprPtr>&);
+  bool IsPure() const { return true; }
 };
 
-ValuePtr BReturn::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+ValuePtr BFor::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
 {
-  assert(args.size() == 0 || args.size() == 1);
+  assert(args.size() == 4 || args.size() == 5);
 
-  TypePtr rty = VoidType;
-  if(!args.empty()) {
-    checker.Visit(args[0].get());
-    if(!args[0]->value)
+  // bounds and step
+  for(size_t i = 1; i < args.size() - 1; i++)
+  {
+    TypeSubst lastSubst;
+    checker.subst.swap(lastSubst);
+
+    checker.Visit(args[i].get());
+    if(!args[i]->value)
       return {};
-    rty = args[0]->value->type;
+
+    Compose(lastSubst, checker.subst);
+    if(i != 1)
+      Compose(Unify(*args[i]->value->type, *args[1]->value->type), checker.subst);
   }
 
-  if(checker.returnType)
-    Compose(Unify(*rty, *checker.returnType), checker.subst);
-  else
-    checker.returnType = rty;
+  auto type = xra::Apply(checker.subst, *args[1]->value->type);
+  if(!isa<TInteger>(type.get())) {
+    Error() << "for requires integer bounds";
+    return {};
+  }
+
+  // the loop variable is only bound in the body, and like a parameter is
+  // never assigned
+  Env::Scope scope(checker.env);
+  ValuePtr counter = new VLocal(checker.functions.empty() ? nullptr : checker.functions.back(), true);
+  counter->type = type;
+  args[0]->value = counter;
+  checker.env.AddValue(static_cast<EVariable&>(*args[0]).name, counter);
+
+  TypeSubst boundsSubst;
+  checker.subst.swap(boundsSubst);
+
+  bool lastInsideLoop = checker.insideLoop;
+  checker.insideLoop = true;
+  checker.Visit(args.back().get());
+  checker.insideLoop = lastInsideLoop;
+  if(!args.back()->value)
+    return {};
+
+  Compose(boundsSubst, checker.subst);
 
   return VoidValue;
 }
 
-void BReturn::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+// (to - from - 1) / step + 1 iterations, computed unsigned so that it
+// cannot overflow; only meaningful where runs, which is false for an empty
+// range or a step that is not positive
+static llvm::Value* CreateTripCount(llvm::IRBuilder<>& builder, llvm::Value* from, llvm::Value* to,
+                                    llvm::Value* step, bool isSigned, llvm::Value*& runs)
 {
-  assert(args.size() == 0 || args.size() == 1);
+  auto type = from->getType();
+  auto zero = llvm::ConstantInt::get(type, 0);
+  auto one = llvm::ConstantInt::get(type, 1);
+
+  auto nonEmpty = isSigned ? builder.CreateICmpSLT(from, to) : builder.CreateICmpULT(from, to);
+  auto forward = isSigned ? builder.CreateICmpSGT(step, zero) : builder.CreateICmpNE(step, zero);
+  runs = builder.CreateAnd(nonEmpty, forward);
+  auto divisor = builder.CreateSelect(forward, step, one);
+  auto distance = builder.CreateSub(builder.CreateSub(to, from), one);
+  return builder.CreateAdd(builder.CreateUDiv(distance, divisor), one, "tripcount");
+}
+
+// a distinct llvm.loop node identifies the loop to later passes
+static llvm::MDNode* CreateLoopID(llvm::LLVMContext& ctx)
+{
+  auto temp = llvm::MDNode::getTemporary(ctx, llvm::ArrayRef<llvm::Value*>());
+  vector<llvm::Value*> operands{temp};
+  auto id = llvm::MDNode::get(ctx, operands);
+  id->replaceOperandWith(0, id);
+  llvm::MDNode::deleteTemporary(temp);
+  return id;
+}
+
+void BFor::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 4 || args.size() == 5);
 
   auto& builder = compiler.builder;
+  auto& ctx = compiler.module.getContext();
   auto func = builder.GetInsertBlock()->getParent();
-  auto contBlock = llvm::BasicBlock::Create(builder.getContext(), "returncont", func);
+  auto& name = static_cast<EVariable&>(*args[0]).name;
+  bool isSigned = static_cast<TInteger&>(*args[0]->value->type)._signed;
 
-  if(!args.empty())
-    compiler.Visit(args[0].get());
-  builder.CreateRet(compiler.Load(compiler.result));
+  compiler.Visit(args[1].get());
+  auto from = compiler.Load(compiler.result);
+  compiler.Visit(args[2].get());
+  auto to = compiler.Load(compiler.result);
+
+  auto type = from->getType();
+  auto zero = llvm::ConstantInt::get(type, 0);
+  auto one = llvm::ConstantInt::get(type, 1);
+
+  llvm::Value* step = one;
+  if(args.size() == 5) {
+    compiler.Visit(args[3].get());
+    step = compiler.Load(compiler.result);
+  }
   compiler.result = nullptr;
 
-  builder.SetInsertPoint(contBlock);
-}
+  llvm::Value* runs;
+  auto count = CreateTripCount(builder, from, to, step, isSigned, runs);
 
-/*
- * BBreak
- */
+  auto preheader = builder.GetInsertBlock();
+  auto bodyBlock = llvm::BasicBlock::Create(ctx, "for", func);
+  auto latchBlock = llvm::BasicBlock::Create(ctx, "fornext");
+  auto lastEndLoopBlock = compiler.endLoopBlock;
+  auto lastLoopRegionDepth = compiler.loopRegionDepth;
+  compiler.endLoopBlock = llvm::BasicBlock::Create(ctx, "endfor");
+  compiler.loopRegionDepth = compiler.regionDepth;
 
-class BBreak : public VBuiltin
-{
-public:
-  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
-  void Compile(Compiler&, const vector<ExprPtr>&);
-};
+  builder.CreateCondBr(runs, bodyBlock, compiler.endLoopBlock);
 
-ValuePtr BBreak::Infer(TypeChecker& checker, const vector<ExprPtr>&)
-{
-  if(!checker.insideLoop) {
-    Error() << "break used outside loop";
-    return {};
-  }
+  // body
+  builder.SetInsertPoint(bodyBlock);
+  auto index = builder.CreatePHI(type, 2, "index");
+  index->addIncoming(zero, preheader);
 
-  return VoidValue;
-}
+  auto previousValue = compiler.values[name];
+  compiler.values[name] = builder.CreateAdd(from, builder.CreateMul(index, step), name);
 
-void BBreak::Compile(Compiler& compiler, const vector<ExprPtr>&)
-{
-  auto& builder = compiler.builder;
-  auto func = builder.GetInsertBlock()->getParent();
-  auto contBlock = llvm::BasicBlock::Create(builder.getContext(), "breakcont", func);
+  compiler.Visit(args.back().get());
+  compiler.result = nullptr;
+  builder.CreateBr(latchBlock);
 
-  builder.CreateBr(compiler.endLoopBlock);
-  builder.SetInsertPoint(contBlock);
+  compiler.values[name] = previousValue;
+
+  // next
+  func->getBasicBlockList().push_back(latchBlock);
+  builder.SetInsertPoint(latchBlock);
+  auto next = builder.CreateNUWAdd(index, one, "index.next");
+  index->addIncoming(next, latchBlock);
+  auto backedge = builder.CreateCondBr(builder.CreateICmpULT(next, count), bodyBlock, compiler.endLoopBlock);
+  backedge->setMetadata("llvm.loop", CreateLoopID(ctx));
+
+  // endloop
+  func->getBasicBlockList().push_back(compiler.endLoopBlock);
+  builder.SetInsertPoint(compiler.endLoopBlock);
+  compiler.endLoopBlock = lastEndLoopBlock;
+  compiler.loopRegionDepth = lastLoopRegionDepth;
 }
 
 /*
- * BModule
+ * BParallel
+ *
+ * parallel [chunk n] [reduce op] for i in from..to [by step] splits the
+ * iterations into chunks of n consecutive ones and hands them to the
+ * runtime's thread pool (runtime-parallel.cpp). The body is outlined into
+ * its own function of i; a chunk function created here runs it over one
+ * chunk. Without a chunk size the range is cut into about ParallelChunks
+ * pieces. Since chunks depend only on the range and never on the number of
+ * threads, and a reduction folds each chunk in order and then the chunks'
+ * results in order, results are the same on every run.
  */
 
-class BModule : public VBuiltin
+// chunks a range is cut into when the loop does not choose a size
+static const uint64_t ParallelChunks = 1024;
+
+class BParallel : public VBuiltin
 {
 public:
   ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
   void Compile(Compiler&, const vector<ExprPtr>&);
 };
 
-static string AbsoluteModule(const string& currentModule, const string& modulePath)
+ValuePtr BParallel::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
 {
-  if(modulePath[0] == '.')
-    return modulePath.substr(1);
+  assert(args.size() == 5 || args.size() == 6);
 
-  if(currentModule.empty())
-    return modulePath;
+  auto reduce = dyn_cast<EVariable>(args[0].get());
+  if(reduce && reduce->name != "+" && reduce->name != "*" && reduce->name != "&" &&
+     reduce->name != "|" && reduce->name != "^") {
+    Error() << "parallel cannot reduce with " << reduce->name;
+    return {};
+  }
 
-  return currentModule + "." + modulePath;
-}
+  // bounds, step and chunk size
+  for(size_t i = 1; i < args.size() - 1; i++)
+  {
+    if(isa<EList>(args[i].get()))
+      continue;
+
+    TypeSubst lastSubst;
+    checker.subst.swap(lastSubst);
+
+    checker.Visit(args[i].get());
+    if(!args[i]->value)
+      return {};
+
+    Compose(lastSubst, checker.subst);
+    if(i > 2)
+      Compose(Unify(*args[i]->value->type, *args[2]->value->type), checker.subst);
+  }
+
+  auto type = xra::Apply(checker.subst, *args[2]->value->type);
+  if(!isa<TInteger>(type.get())) {
+    Error() << "parallel for requires integer bounds";
+    return {};
+  }
+  if(!isa<EList>(args[1].get()) && !isa<TInteger>(xra::Apply(checker.subst, *args[1]->value->type).get())) {
+    Error() << "parallel chunk size must be an integer";
+    return {};
+  }
+
+  // the body's parameter is the loop variable
+  auto& body = static_cast<EFunction&>(*args.back());
+  static_cast<TList&>(*body.param).fields[0].type = type;
+
+  TypeSubst boundsSubst;
+  checker.subst.swap(boundsSubst);
+
+  checker.Visit(&body);
+  if(!body.value)
+    return {};
+
+  Compose(boundsSubst, checker.subst);
+
+  if(!reduce)
+    return VoidValue;
+
+  auto resultType = xra::Apply(checker.subst, *body.body->value->type);
+  bool isBitwise = reduce->name != "+" && reduce->name != "*";
+  if(!isa<TInteger>(resultType.get()) && (isBitwise || !isa<TFloat>(resultType.get()))) {
+    Error() << "parallel reduce " << reduce->name << " requires "
+            << (isBitwise ? "an integer" : "a numeric") << " body";
+    return {};
+  }
+
+  ValuePtr value = new VTemporary;
+  value->type = resultType;
+  return value;
+}
+
+static llvm::Constant* ReductionIdentity(const string& op, llvm::Type* type)
+{
+  if(op == "*")
+    return type->isFloatingPointTy() ? llvm::ConstantFP::get(type, 1.0) : llvm::ConstantInt::get(type, 1);
+  if(op == "&")
+    return llvm::Constant::getAllOnesValue(type);
+  return llvm::Constant::getNullValue(type);
+}
+
+static llvm::Value* CreateReduction(llvm::IRBuilder<>& builder, const string& op, llvm::Value* left, llvm::Value* right)
+{
+  bool isFloat = left->getType()->isFloatingPointTy();
+  if(op == "+")
+    return isFloat ? builder.CreateFAdd(left, right) : builder.CreateAdd(left, right);
+  if(op == "*")
+    return isFloat ? builder.CreateFMul(left, right) : builder.CreateMul(left, right);
+  if(op == "&")
+    return builder.CreateAnd(left, right);
+  if(op == "|")
+    return builder.CreateOr(left, right);
+  return builder.CreateXor(left, right);
+}
+
+// the loop's state shared by every chunk
+enum ParallelContextField { ContextEnv, ContextFrom, ContextStep, ContextCount, ContextChunk, ContextPartials };
+
+// void (i8* context, i64 chunk): runs the body for the iterations of one
+// chunk, storing its part of a reduction in partials[chunk]
+static llvm::Function* CreateChunkFunction(Compiler& compiler, llvm::Function* code,
+                                           llvm::StructType* contextType, const string& reduceOp)
+{
+  auto& builder = compiler.builder;
+  auto& ctx = compiler.module.getContext();
+
+  vector<llvm::Type*> params{builder.getInt8PtrTy(), builder.getInt64Ty()};
+  auto chunkFunc = llvm::Function::Create(llvm::FunctionType::get(builder.getVoidTy(), params, false),
+                                          llvm::Function::InternalLinkage, code->getName() + ".chunk",
+                                          &compiler.module);
+
+  auto previousInsertPoint = builder.saveIP();
+  auto entryBlock = llvm::BasicBlock::Create(ctx, "entry", chunkFunc);
+  builder.SetInsertPoint(entryBlock);
+
+  auto arg = chunkFunc->arg_begin();
+  llvm::Value* contextArg = &*arg++;
+  llvm::Value* chunkIndex = &*arg;
+  contextArg->setName("context");
+  chunkIndex->setName("chunk");
+
+  auto context = builder.CreateBitCast(contextArg, contextType->getPointerTo());
+  auto env = builder.CreateLoad(builder.CreateStructGEP(context, ContextEnv), "env");
+  auto from = builder.CreateLoad(builder.CreateStructGEP(context, ContextFrom), "from");
+  auto step = builder.CreateLoad(builder.CreateStructGEP(context, ContextStep), "step");
+  auto count = builder.CreateLoad(builder.CreateStructGEP(context, ContextCount), "count");
+  auto chunk = builder.CreateLoad(builder.CreateStructGEP(context, ContextChunk), "chunksize");
+
+  // the runtime only asks for chunks that hold at least one iteration
+  auto begin = builder.CreateMul(chunkIndex, chunk, "begin");
+  auto remaining = builder.CreateSub(count, begin);
+  auto size = builder.CreateSelect(builder.CreateICmpULT(chunk, remaining), chunk, remaining);
+  auto end = builder.CreateAdd(begin, size, "end");
+
+  auto loopBlock = llvm::BasicBlock::Create(ctx, "loop", chunkFunc);
+  auto exitBlock = llvm::BasicBlock::Create(ctx, "exit", chunkFunc);
+  builder.CreateBr(loopBlock);
+
+  builder.SetInsertPoint(loopBlock);
+  auto index = builder.CreatePHI(builder.getInt64Ty(), 2, "index");
+  index->addIncoming(begin, entryBlock);
+
+  llvm::PHINode* acc = nullptr;
+  if(!reduceOp.empty()) {
+    acc = builder.CreatePHI(code->getReturnType(), 2, "acc");
+    acc->addIncoming(ReductionIdentity(reduceOp, code->getReturnType()), entryBlock);
+  }
+
+  auto counter = builder.CreateTrunc(index, from->getType());
+  vector<llvm::Value*> callArgs{builder.CreateAdd(from, builder.CreateMul(counter, step)), env};
+  auto call = builder.CreateCall(code, callArgs);
+  call->setCallingConv(code->getCallingConv());
+
+  llvm::Value* nextAcc = nullptr;
+  if(acc) {
+    nextAcc = CreateReduction(builder, reduceOp, acc, call);
+    acc->addIncoming(nextAcc, loopBlock);
+  }
+
+  auto next = builder.CreateNUWAdd(index, builder.getInt64(1), "index.next");
+  index->addIncoming(next, loopBlock);
+  builder.CreateCondBr(builder.CreateICmpULT(next, end), loopBlock, exitBlock);
+
+  builder.SetInsertPoint(exitBlock);
+  if(acc) {
+    auto partials = builder.CreateLoad(builder.CreateStructGEP(context, ContextPartials), "partials");
+    builder.CreateStore(nextAcc, builder.CreateGEP(partials, chunkIndex));
+  }
+  builder.CreateRetVoid();
+  verifyFunction(*chunkFunc);
+
+  builder.restoreIP(previousInsertPoint);
+  return chunkFunc;
+}
+
+void BParallel::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 5 || args.size() == 6);
+
+  auto& builder = compiler.builder;
+  auto& ctx = compiler.module.getContext();
+  auto func = builder.GetInsertBlock()->getParent();
+  auto& body = static_cast<const EFunction&>(*args.back());
+  auto reduce = dyn_cast<EVariable>(args[0].get());
+  string reduceOp = reduce ? reduce->name : "";
+  bool isSigned = static_cast<TInteger&>(*args[2]->value->type)._signed;
+
+  compiler.Visit(args[2].get());
+  auto from = compiler.Load(compiler.result);
+  compiler.Visit(args[3].get());
+  auto to = compiler.Load(compiler.result);
+
+  auto type = from->getType();
+  llvm::Value* step = llvm::ConstantInt::get(type, 1);
+  if(args.size() == 6) {
+    compiler.Visit(args[4].get());
+    step = compiler.Load(compiler.result);
+  }
+
+  llvm::Value* runs;
+  auto tripCount = CreateTripCount(builder, from, to, step, isSigned, runs);
+  tripCount = builder.CreateSelect(runs, tripCount, llvm::ConstantInt::get(type, 0));
+  auto count = builder.CreateZExtOrBitCast(tripCount, builder.getInt64Ty(), "count");
+
+  auto zero = builder.getInt64(0);
+  auto one = builder.getInt64(1);
+
+  llvm::Value* chunk;
+  if(!isa<EList>(args[1].get())) {
+    compiler.Visit(args[1].get());
+    chunk = builder.CreateIntCast(compiler.Load(compiler.result), builder.getInt64Ty(),
+                                  static_cast<TInteger&>(*args[1]->value->type)._signed);
+    chunk = builder.CreateSelect(builder.CreateICmpSGT(chunk, zero), chunk, one, "chunksize");
+  }
+  else {
+    chunk = builder.CreateAdd(builder.CreateUDiv(count, builder.getInt64(ParallelChunks)), one, "chunksize");
+  }
+  auto partialChunk = builder.CreateZExt(builder.CreateICmpNE(builder.CreateURem(count, chunk), zero), builder.getInt64Ty());
+  auto chunks = builder.CreateAdd(builder.CreateUDiv(count, chunk), partialChunk, "chunks");
+
+  // the body's environment stays on this frame's stack, which outlives the loop
+  compiler.Visit(&body);
+  auto code = compiler.knownFunctions[&body].code;
+  auto env = builder.CreateExtractValue(compiler.result, 1, "env");
+  compiler.result = nullptr;
+
+  auto resultType = code->getReturnType();
+  llvm::Value* partials = llvm::Constant::getNullValue(resultType->isVoidTy() ? builder.getInt8PtrTy()
+                                                                              : resultType->getPointerTo());
+  if(reduce) {
+    vector<llvm::Type*> mallocParams{builder.getInt64Ty()};
+    auto mallocType = llvm::FunctionType::get(builder.getInt8PtrTy(), mallocParams, false);
+    auto size = builder.CreateMul(chunks, llvm::ConstantExpr::getSizeOf(resultType));
+    auto memory = builder.CreateCall(compiler.module.getOrInsertFunction("malloc", mallocType), size);
+    partials = builder.CreateBitCast(memory, resultType->getPointerTo(), "partials");
+  }
+
+  vector<llvm::Type*> fieldTypes{env->getType(), type, type, builder.getInt64Ty(), builder.getInt64Ty(),
+                                 partials->getType()};
+  auto contextType = llvm::StructType::get(ctx, fieldTypes, false);
+  auto context = compiler.CreateEntryAlloca(contextType, "context");
+  compiler.hasStackEnv = true;
+
+  vector<llvm::Value*> fields{env, from, step, count, chunk, partials};
+  for(unsigned int i = 0; i < fields.size(); i++)
+    builder.CreateStore(fields[i], builder.CreateStructGEP(context, i));
+
+  auto chunkFunc = CreateChunkFunction(compiler, code, contextType, reduceOp);
+
+  vector<llvm::Type*> runtimeParams{builder.getInt64Ty(), chunkFunc->getType(), builder.getInt8PtrTy()};
+  auto runtimeType = llvm::FunctionType::get(builder.getVoidTy(), runtimeParams, false);
+  vector<llvm::Value*> runtimeArgs{chunks, chunkFunc, builder.CreateBitCast(context, builder.getInt8PtrTy())};
+  builder.CreateCall(compiler.module.getOrInsertFunction("xra_parallel_for", runtimeType), runtimeArgs);
+
+  if(!reduce)
+    return;
+
+  // fold the chunks' results in order
+  auto preheader = builder.GetInsertBlock();
+  auto combineBlock = llvm::BasicBlock::Create(ctx, "combine", func);
+  auto addBlock = llvm::BasicBlock::Create(ctx, "combineadd", func);
+  auto doneBlock = llvm::BasicBlock::Create(ctx, "combined", func);
+  builder.CreateBr(combineBlock);
+
+  builder.SetInsertPoint(combineBlock);
+  auto index = builder.CreatePHI(builder.getInt64Ty(), 2, "index");
+  auto acc = builder.CreatePHI(resultType, 2, "acc");
+  index->addIncoming(zero, preheader);
+  acc->addIncoming(ReductionIdentity(reduceOp, resultType), preheader);
+  builder.CreateCondBr(builder.CreateICmpULT(index, chunks), addBlock, doneBlock);
+
+  builder.SetInsertPoint(addBlock);
+  auto partial = builder.CreateLoad(builder.CreateGEP(partials, index));
+  acc->addIncoming(CreateReduction(builder, reduceOp, acc, partial), addBlock);
+  index->addIncoming(builder.CreateNUWAdd(index, one), addBlock);
+  builder.CreateBr(combineBlock);
+
+  builder.SetInsertPoint(doneBlock);
+  vector<llvm::Type*> freeParams{builder.getInt8PtrTy()};
+  auto freeType = llvm::FunctionType::get(builder.getVoidTy(), freeParams, false);
+  builder.CreateCall(compiler.module.getOrInsertFunction("free", freeType),
+                     builder.CreateBitCast(partials, builder.getInt8PtrTy()));
+
+  compiler.result = acc;
+}
+
+/*
+ * BReturn
+ */
+
+class BReturn : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+  bool IsPure() const { return true; }
+};
+
+ValuePtr BReturn::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 0 || args.size() == 1);
+
+  // it would only leave the body, not the function around the loop
+  if(!checker.functions.empty() && checker.functions.back()->loopBody) {
+    Error() << "return used inside a for over a generator";
+    return {};
+  }
+
+  TypePtr rty = VoidType;
+  if(!args.empty()) {
+    checker.Visit(args[0].get());
+    if(!args[0]->value)
+      return {};
+    rty = args[0]->value->type;
+  }
+
+  if(checker.returnType)
+    Compose(Unify(*rty, *checker.returnType), checker.subst);
+  else
+    checker.returnType = rty;
+
+  return VoidValue;
+}
+
+void BReturn::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 0 || args.size() == 1);
+
+  auto& builder = compiler.builder;
+  auto func = builder.GetInsertBlock()->getParent();
+  auto contBlock = llvm::BasicBlock::Create(builder.getContext(), "returncont", func);
+
+  // regions still have to be left after the value is computed
+  if(!args.empty())
+    compiler.Visit(args[0].get(), compiler.regionDepth == 0);
+  auto value = compiler.Load(compiler.result);
+  compiler.LeaveRegions(0);
+  builder.CreateRet(value);
+  compiler.result = nullptr;
+
+  builder.SetInsertPoint(contBlock);
+}
+
+/*
+ * BBreak
+ */
+
+class BBreak : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+  bool IsPure() const { return true; }
+};
+
+ValuePtr BBreak::Infer(TypeChecker& checker, const vector<ExprPtr>&)
+{
+  if(!checker.insideLoop) {
+    Error() << "break used outside loop";
+    return {};
+  }
+
+  return VoidValue;
+}
+
+void BBreak::Compile(Compiler& compiler, const vector<ExprPtr>&)
+{
+  auto& builder = compiler.builder;
+  auto func = builder.GetInsertBlock()->getParent();
+  auto contBlock = llvm::BasicBlock::Create(builder.getContext(), "breakcont", func);
+
+  compiler.LeaveRegions(compiler.loopRegionDepth);
+  builder.CreateBr(compiler.endLoopBlock);
+  builder.SetInsertPoint(contBlock);
+}
+
+/*
+ * BYield
+ *
+ * Generators are compiled as internal iterators: a for over one passes its
+ * body as a closure that yield calls, and that returns false on break. The
+ * body's environment stays on the loop's stack, and once the optimizer
+ * inlines the generator (or specializes it on the constant body) the pair
+ * becomes a plain loop.
+ */
+
+class BYield : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+};
+
+ValuePtr BYield::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 1);
+
+  auto generator = checker.functions.empty() ? nullptr : checker.functions.back();
+  if(!generator || !generator->generator) {
+    Error() << "yield used outside a generator";
+    return {};
+  }
+
+  checker.Visit(args[0].get());
+  if(!args[0]->value)
+    return {};
+
+  auto param = make_unique<TList>();
+  param->fields.push_back({string(), args[0]->value->type});
+  TypePtr consumerType = new TFunction(param.release(), BooleanType);
+
+  auto& consumer = static_cast<TList&>(*generator->param).fields.back();
+  Compose(Unify(*xra::Apply(checker.subst, *consumer.type), *consumerType), checker.subst);
+
+  return VoidValue;
+}
+
+void BYield::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 1);
+
+  auto& builder = compiler.builder;
+  auto func = builder.GetInsertBlock()->getParent();
+  auto& consumer = static_cast<TList&>(*compiler.function->param).fields.back();
+
+  vector<llvm::Value*> arguments;
+  compiler.FlattenArgument(*args[0], arguments);
+
+  auto closure = compiler.Load(compiler.values[consumer.name]);
+  arguments.push_back(builder.CreateExtractValue(closure, 1));
+  auto call = builder.CreateCall(builder.CreateExtractValue(closure, 0), arguments, "more");
+  call->setCallingConv(llvm::CallingConv::Fast);
+
+  auto stopBlock = llvm::BasicBlock::Create(builder.getContext(), "stop", func);
+  auto contBlock = llvm::BasicBlock::Create(builder.getContext(), "yieldcont", func);
+  builder.CreateCondBr(call, contBlock, stopBlock);
+
+  builder.SetInsertPoint(stopBlock);
+  compiler.LeaveRegions(0);
+  builder.CreateRetVoid();
+
+  builder.SetInsertPoint(contBlock);
+  compiler.result = nullptr;
+}
+
+/*
+ * BRegion
+ *
+ * region: body frees everything the body allocates on the heap when it
+ * ends, so values made inside must not be used after it. Its value is the
+ * body's.
+ */
+
+class BRegion : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+};
+
+// whether a value of this type is plain data, with no pointer that could
+// lead into memory allocated in a region
+static bool IsPlainData(const Type& type)
+{
+  if(IsScalar(type))
+    return true;
+  if(auto list = dyn_cast<TList>(&type)) {
+    for(auto& field : list->fields) {
+      if(!IsPlainData(*field.type))
+        return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+ValuePtr BRegion::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 1);
+
+  checker.Visit(args[0].get());
+  if(!args[0]->value)
+    return {};
+
+  // everything the body allocated is freed when the region is left
+  auto type = xra::Apply(checker.subst, *args[0]->value->type);
+  if(!IsPlainData(*type)) {
+    Error() << "region cannot yield a value of type " << *type << ", which may point into it";
+    return {};
+  }
+
+  ValuePtr value = new VTemporary;
+  value->type = args[0]->value->type;
+  return value;
+}
+
+void BRegion::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 1);
+
+  compiler.CreateRegionCall("xra_region_push");
+  compiler.regionDepth++;
+
+  compiler.Visit(args[0].get());
+  auto value = compiler.Load(compiler.result);
+
+  compiler.regionDepth--;
+  compiler.CreateRegionCall("xra_region_pop");
+  compiler.result = value;
+}
+
+/*
+ * BModule
+ */
+
+class BModule : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+};
+
+static string AbsoluteModule(const string& currentModule, const string& modulePath)
+{
+  if(modulePath[0] == '.')
+    return modulePath.substr(1);
+
+  if(currentModule.empty())
+    return modulePath;
+
+  return currentModule + "." + modulePath;
+}
 
 ValuePtr BModule::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
 {
   auto module = static_cast<EVariable&>(*args[0]).name;
   module = AbsoluteModule(checker.moduleName, module);
 
-  checker.moduleName.swap(module);
-  checker.Visit(args[1].get());
-  checker.moduleName.swap(module);
+  checker.moduleName.swap(module);
+  checker.Visit(args[1].get());
+  checker.moduleName.swap(module);
+
+  return VoidValue;
+}
+
+void BModule::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  compiler.Visit(args[1].get(), compiler.tailPosition);
+}
+
+/*
+ * BUsing
+ */
+
+class BUsing : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+};
+
+ValuePtr BUsing::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  auto module = static_cast<EVariable&>(*args[0]).name;
+  module = AbsoluteModule(checker.moduleName, module);
+
+  if(!checker.usingModules.insert(module).second) {
+    Error() << "duplicate using: " << module;
+    return {};
+  }
+  checker.Visit(args[1].get());
+  checker.usingModules.erase(module);
+
+  return VoidValue;
+}
+
+void BUsing::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  compiler.Visit(args[1].get(), compiler.tailPosition);
+}
+
+/*
+ * BArithmetic
+ */
+
+// Integer operations are picked by signedness. The plain +, - and * promise
+// no overflow (nsw/nuw), which lets the loop passes reason about induction
+// variables; +% -% *% wrap, and +! -! *! trap on overflow.
+#define ARITHMETIC_OP(c, sop, uop, fop, ic, spec) \
+  struct c { \
+    static llvm::Value* IntOp(llvm::IRBuilder<>& b, llvm::Value* l, llvm::Value* r, bool isSigned) { \
+      return isSigned ? b.Create##sop(l, r) : b.Create##uop(l, r); \
+    } \
+    static llvm::Value* FloatOp(llvm::IRBuilder<>& b, llvm::Value* l, llvm::Value* r) { \
+      return b.Create##fop(l, r); \
+    } \
+    typedef ic IsCompare; \
+    static const bool Speculatable = spec; \
+    static const char* IntegerOnly() { return nullptr; } \
+  }
+
+// bitwise operations; >> is arithmetic on signed and logical on unsigned integers
+#define BITWISE_OP(c, sop, uop) \
+  struct c { \
+    static llvm::Value* IntOp(llvm::IRBuilder<>& b, llvm::Value* l, llvm::Value* r, bool isSigned) { \
+      return isSigned ? b.Create##sop(l, r) : b.Create##uop(l, r); \
+    } \
+    static llvm::Value* FloatOp(llvm::IRBuilder<>&, llvm::Value*, llvm::Value*) { \
+      llvm_unreachable("bitwise operation on float"); \
+    } \
+    typedef false_type IsCompare; \
+    static const bool Speculatable = true; \
+    static const char* IntegerOnly() { return "Bitwise operation requires integer operands"; } \
+  }
+
+static llvm::Value* CreateCheckedOp(llvm::IRBuilder<>& b, llvm::Intrinsic::ID id, llvm::Value* l, llvm::Value* r)
+{
+  auto& ctx = b.getContext();
+  auto func = b.GetInsertBlock()->getParent();
+  auto module = func->getParent();
+
+  vector<llvm::Type*> types{l->getType()};
+  vector<llvm::Value*> operands{l, r};
+  auto pair = b.CreateCall(llvm::Intrinsic::getDeclaration(module, id, types), operands);
+
+  auto overflowBlock = llvm::BasicBlock::Create(ctx, "overflow", func);
+  auto contBlock = llvm::BasicBlock::Create(ctx, "nooverflow", func);
+  b.CreateCondBr(b.CreateExtractValue(pair, 1), overflowBlock, contBlock);
+
+  b.SetInsertPoint(overflowBlock);
+  b.CreateCall(llvm::Intrinsic::getDeclaration(module, llvm::Intrinsic::trap));
+  b.CreateUnreachable();
+
+  b.SetInsertPoint(contBlock);
+  return b.CreateExtractValue(pair, 0);
+}
+
+// float operands have no overflow to check and are rejected
+#define CHECKED_OP(c, sid, uid) \
+  struct c { \
+    static llvm::Value* IntOp(llvm::IRBuilder<>& b, llvm::Value* l, llvm::Value* r, bool isSigned) { \
+      return CreateCheckedOp(b, isSigned ? llvm::Intrinsic::sid : llvm::Intrinsic::uid, l, r); \
+    } \
+    static llvm::Value* FloatOp(llvm::IRBuilder<>&, llvm::Value*, llvm::Value*) { \
+      llvm_unreachable("checked operation on float"); \
+    } \
+    typedef false_type IsCompare; \
+    static const bool Speculatable = false; \
+    static const char* IntegerOnly() { return "Checked arithmetic requires integer operands"; } \
+  }
+
+ARITHMETIC_OP(Add, NSWAdd, NUWAdd, FAdd, false_type, true);
+ARITHMETIC_OP(Sub, NSWSub, NUWSub, FSub, false_type, true);
+ARITHMETIC_OP(Mul, NSWMul, NUWMul, FMul, false_type, true);
+ARITHMETIC_OP(Div, SDiv, UDiv, FDiv, false_type, false);
+ARITHMETIC_OP(Rem, SRem, URem, FRem, false_type, false);
+ARITHMETIC_OP(WrapAdd, Add, Add, FAdd, false_type, true);
+ARITHMETIC_OP(WrapSub, Sub, Sub, FSub, false_type, true);
+ARITHMETIC_OP(WrapMul, Mul, Mul, FMul, false_type, true);
+CHECKED_OP(CheckedAdd, sadd_with_overflow, uadd_with_overflow);
+CHECKED_OP(CheckedSub, ssub_with_overflow, usub_with_overflow);
+CHECKED_OP(CheckedMul, smul_with_overflow, umul_with_overflow);
+ARITHMETIC_OP(EQ, ICmpEQ, ICmpEQ, FCmpOEQ, true_type, true);
+ARITHMETIC_OP(NE, ICmpNE, ICmpNE, FCmpONE, true_type, true);
+ARITHMETIC_OP(LT, ICmpSLT, ICmpULT, FCmpOLT, true_type, true);
+ARITHMETIC_OP(LE, ICmpSLE, ICmpULE, FCmpOLE, true_type, true);
+ARITHMETIC_OP(GT, ICmpSGT, ICmpUGT, FCmpOGT, true_type, true);
+ARITHMETIC_OP(GE, ICmpSGE, ICmpUGE, FCmpOGE, true_type, true);
+BITWISE_OP(And, And, And);
+BITWISE_OP(Or, Or, Or);
+BITWISE_OP(Xor, Xor, Xor);
+BITWISE_OP(Shl, Shl, Shl);
+BITWISE_OP(Shr, AShr, LShr);
+
+#undef CHECKED_OP
+#undef BITWISE_OP
+#undef ARITHMETIC_OP
+
+template<typename IsCompare>
+TypePtr ResultType(TypePtr);
+
+template<>
+TypePtr ResultType<false_type>(TypePtr type) { return type; }
+
+template<>
+TypePtr ResultType<true_type>(TypePtr) { return BooleanType; }
+
+// == and != test strings for equality without ordering them
+template<class Operation>
+struct IsEquality : false_type {};
+
+template<>
+struct IsEquality<EQ> : true_type {};
+
+template<>
+struct IsEquality<NE> : true_type {};
+
+// + and - fuse with a multiplication operand under fast math
+template<class Operation>
+struct IsContractible : false_type {};
+
+template<>
+struct IsContractible<Add> : true_type {};
+
+template<>
+struct IsContractible<Sub> : true_type {};
+
+static llvm::Value* ApplyFastMath(Compiler& compiler, llvm::Value* value)
+{
+  auto inst = dyn_cast<llvm::Instruction>(value);
+  if(compiler.fastMath && inst) {
+    llvm::FastMathFlags flags;
+    flags.setUnsafeAlgebra();
+    flags.setNoNaNs();
+    flags.setNoInfs();
+    inst->setFastMathFlags(flags);
+  }
+  return value;
+}
+
+// a*b+c, a*b-c and c-a*b become llvm.fmuladd, which the backend fuses into
+// a single instruction where the target has one
+template<class Operation>
+static llvm::Value* CreateMulAdd(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  auto& builder = compiler.builder;
+  bool isSub = is_same<Operation, Sub>::value;
+
+  auto product = BuiltinArgs(*args[0], "*");
+  bool productFirst = (product != nullptr);
+  if(!product)
+    product = BuiltinArgs(*args[1], "*");
+  if(!product || product->size() != 2)
+    return nullptr;
+  auto& addend = productFirst ? args[1] : args[0];
+
+  // operands are still evaluated left to right
+  llvm::Value* c = nullptr;
+  if(!productFirst) {
+    compiler.Visit(addend.get());
+    c = compiler.Load(compiler.result);
+  }
+  compiler.Visit((*product)[0].get());
+  auto a = compiler.Load(compiler.result);
+  compiler.Visit((*product)[1].get());
+  auto b = compiler.Load(compiler.result);
+  if(productFirst) {
+    compiler.Visit(addend.get());
+    c = compiler.Load(compiler.result);
+  }
+
+  if(isSub && productFirst)
+    c = ApplyFastMath(compiler, builder.CreateFNeg(c));
+  else if(isSub)
+    a = ApplyFastMath(compiler, builder.CreateFNeg(a));
+
+  vector<llvm::Type*> types{a->getType()};
+  vector<llvm::Value*> operands{a, b, c};
+  auto fmuladd = llvm::Intrinsic::getDeclaration(&compiler.module, llvm::Intrinsic::fmuladd, types);
+  return builder.CreateCall(fmuladd, operands, "fmuladd");
+}
+
+template<class Operation>
+class BArithmetic : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+  bool CanSpeculate(const vector<ExprPtr>&, int& budget);
+  bool IsPure() const { return true; }
+};
+
+template<class Operation>
+ValuePtr BArithmetic<Operation>::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  // unary operators reach here too
+  if(args.size() != 2) {
+    Error() << "Binary operator requires two operands";
+    return {};
+  }
+
+  auto& left = args[0];
+  auto& right = args[1];
+
+  checker.Visit(left.get());
+  if(!left->value)
+    return {};
+
+  TypeSubst leftSubst;
+  checker.subst.swap(leftSubst);
+
+  checker.Visit(right.get());
+  if(!right->value)
+    return {};
+
+  Compose(leftSubst, checker.subst);
+  Compose(Unify(*left->value->type, *right->value->type), checker.subst);
+
+  auto type = left->value->type.get();
+  if(Operation::IsCompare::value && isa<TString>(type)) {
+    ValuePtr value = new VTemporary;
+    value->type = BooleanType;
+    return value;
+  }
+  if(Operation::IntegerOnly() && !isa<TInteger>(type)) {
+    Error() << Operation::IntegerOnly();
+    return {};
+  }
+  if(!isa<TInteger>(type) && !isa<TFloat>(type)) {
+    Error() << "Arithmetic operation requires float or integer operands";
+    return {};
+  }
+
+  ValuePtr value = new VTemporary;
+  value->type = ResultType<typename Operation::IsCompare>(type);
+  return value;
+}
+
+template<class Operation>
+void BArithmetic<Operation>::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  assert(args.size() == 2);
+
+  auto type = args[0]->value->type.get();
+  if(IsContractible<Operation>::value && compiler.fastMath && isa<TFloat>(type)) {
+    if((compiler.result = CreateMulAdd<Operation>(compiler, args)))
+      return;
+  }
+
+  compiler.Visit(args[0].get());
+  auto left = compiler.Load(compiler.result);
 
-  return VoidValue;
+  compiler.Visit(args[1].get());
+  auto right = compiler.Load(compiler.result);
+
+  if(auto intType = dyn_cast<TInteger>(type))
+    compiler.result = Operation::IntOp(compiler.builder, left, right, intType->_signed);
+  else if(isa<TString>(type) && IsEquality<Operation>::value) {
+    auto equals = CreateStringEquals(compiler, left, right);
+    compiler.result = Operation::IntOp(compiler.builder, equals, compiler.builder.getTrue(), false);
+  }
+  else if(isa<TString>(type)) {
+    auto zero = compiler.builder.getInt32(0);
+    compiler.result = Operation::IntOp(compiler.builder, CreateStringCompare(compiler, left, right), zero, true);
+  }
+  else if(Operation::IsCompare::value)
+    compiler.result = Operation::FloatOp(compiler.builder, left, right);
+  else
+    compiler.result = ApplyFastMath(compiler, Operation::FloatOp(compiler.builder, left, right));
 }
 
-void BModule::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+// integer division and remainder can trap, so they are never speculated;
+// neither is a string comparison, which is a library call
+template<class Operation>
+bool BArithmetic<Operation>::CanSpeculate(const vector<ExprPtr>& args, int& budget)
 {
-  compiler.Visit(args[1].get());
+  return Operation::Speculatable && !isa<TString>(args[0]->value->type.get()) && --budget >= 0 &&
+    xra::CanSpeculate(*args[0], budget) && xra::CanSpeculate(*args[1], budget);
 }
 
 /*
- * BUsing
+ * BComplement
  */
 
-class BUsing : public VBuiltin
+class BComplement : public VBuiltin
 {
 public:
   ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
   void Compile(Compiler&, const vector<ExprPtr>&);
+  bool CanSpeculate(const vector<ExprPtr>&, int& budget);
+  bool IsPure() const { return true; }
 };
 
-ValuePtr BUsing::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+// the single operand of the bit builtins below
+static ValuePtr InferIntegerOperand(TypeChecker& checker, const ExprPtr& arg, const char* what)
 {
-  auto module = static_cast<EVariable&>(*args[0]).name;
-  module = AbsoluteModule(checker.moduleName, module);
+  checker.Visit(arg.get());
+  if(!arg->value)
+    return {};
 
-  if(!checker.usingModules.insert(module).second) {
-    Error() << "duplicate using: " << module;
+  if(!isa<TInteger>(arg->value->type.get())) {
+    Error() << what << " requires an integer operand";
     return {};
   }
-  checker.Visit(args[1].get());
-  checker.usingModules.erase(module);
 
-  return VoidValue;
+  ValuePtr value = new VTemporary;
+  value->type = arg->value->type;
+  return value;
 }
 
-void BUsing::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+ValuePtr BComplement::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
 {
-  compiler.Visit(args[1].get());
+  assert(args.size() == 1);
+  return InferIntegerOperand(checker, args[0], "~");
+}
+
+void BComplement::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  compiler.Visit(args[0].get());
+  compiler.result = compiler.builder.CreateNot(compiler.Load(compiler.result));
+}
+
+bool BComplement::CanSpeculate(const vector<ExprPtr>& args, int& budget)
+{
+  return --budget >= 0 && xra::CanSpeculate(*args[0], budget);
 }
 
 /*
- * BArithmetic
+ * BBitIntrinsic: popcount, clz, ctz, bswap
  */
 
-#define ARITHMETIC_OP(c, iop, fop, ic) \
-  struct c { \
-    static llvm::Value* IntOp(llvm::IRBuilder<>& b, llvm::Value* l, llvm::Value* r) { \
-      return b.Create##iop(l, r); \
-    } \
-    static llvm::Value* FloatOp(llvm::IRBuilder<>& b, llvm::Value* l, llvm::Value* r) { \
-      return b.Create##fop(l, r); \
-    } \
-    typedef ic IsCompare; \
+class BBitIntrinsic : public VBuiltin
+{
+public:
+  BBitIntrinsic(const char* name_, llvm::Intrinsic::ID id_, bool hasZeroUndef_) :
+    name(name_),
+    id(id_),
+    hasZeroUndef(hasZeroUndef_)
+  {}
+
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+  bool CanSpeculate(const vector<ExprPtr>&, int& budget);
+  bool IsPure() const { return true; }
+
+private:
+  const char* name;
+  llvm::Intrinsic::ID id;
+  bool hasZeroUndef; // ctlz and cttz take an is_zero_undef flag
+};
+
+ValuePtr BBitIntrinsic::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  if(args.size() != 1) {
+    Error() << name << " takes one argument";
+    return {};
   }
 
-ARITHMETIC_OP(Add, Add, FAdd, false_type);
-ARITHMETIC_OP(Sub, Sub, FSub, false_type);
-ARITHMETIC_OP(Mul, Mul, FMul, false_type);
-ARITHMETIC_OP(Div, UDiv, FDiv, false_type);
-ARITHMETIC_OP(Rem, URem, FRem, false_type);
-ARITHMETIC_OP(EQ, ICmpEQ, FCmpOEQ, true_type);
-ARITHMETIC_OP(NE, ICmpNE, FCmpONE, true_type);
-ARITHMETIC_OP(LT, ICmpULT, FCmpOLT, true_type);
-ARITHMETIC_OP(LE, ICmpULE, FCmpOLE, true_type);
-ARITHMETIC_OP(GT, ICmpUGT, FCmpOGT, true_type);
-ARITHMETIC_OP(GE, ICmpUGE, FCmpOGE, true_type);
+  auto value = InferIntegerOperand(checker, args[0], name);
+  if(value && id == llvm::Intrinsic::bswap && static_cast<TInteger&>(*value->type).width % 16 != 0) {
+    Error() << "bswap requires an integer of a whole number of byte pairs";
+    return {};
+  }
+  return value;
+}
 
-#undef ARITHMETIC_OP
+void BBitIntrinsic::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  auto& builder = compiler.builder;
 
-template<typename IsCompare>
-TypePtr ResultType(TypePtr);
+  compiler.Visit(args[0].get());
+  auto operand = compiler.Load(compiler.result);
 
-template<>
-TypePtr ResultType<false_type>(TypePtr type) { return type; }
+  vector<llvm::Type*> types{operand->getType()};
+  vector<llvm::Value*> operands{operand};
+  if(hasZeroUndef)
+    operands.push_back(builder.getFalse());
 
-template<>
-TypePtr ResultType<true_type>(TypePtr) { return BooleanType; }
+  auto intrinsic = llvm::Intrinsic::getDeclaration(&compiler.module, id, types);
+  compiler.result = builder.CreateCall(intrinsic, operands, name);
+}
 
-template<class Operation>
-class BArithmetic : public VBuiltin
+bool BBitIntrinsic::CanSpeculate(const vector<ExprPtr>& args, int& budget)
+{
+  return --budget >= 0 && xra::CanSpeculate(*args[0], budget);
+}
+
+/*
+ * BRotate
+ *
+ * LLVM has no rotate intrinsic; this shift/or pattern with masked amounts is
+ * well-defined for every amount and is matched to rol/ror by the backend.
+ */
+
+template<bool isLeft>
+class BRotate : public VBuiltin
 {
 public:
   ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
   void Compile(Compiler&, const vector<ExprPtr>&);
+  bool CanSpeculate(const vector<ExprPtr>&, int& budget);
+  bool IsPure() const { return true; }
 };
 
-template<class Operation>
-ValuePtr BArithmetic<Operation>::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+template<bool isLeft>
+ValuePtr BRotate<isLeft>::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
 {
-  assert(args.size() == 2);
+  const char* name = isLeft ? "rotl" : "rotr";
+  if(args.size() != 2) {
+    Error() << name << " takes two arguments";
+    return {};
+  }
 
-  auto& left = args[0];
-  auto& right = args[1];
+  auto value = InferIntegerOperand(checker, args[0], name);
+  if(!value)
+    return {};
 
-  checker.Visit(left.get());
-  if(!left->value)
+  TypeSubst valueSubst;
+  checker.subst.swap(valueSubst);
+
+  checker.Visit(args[1].get());
+  if(!args[1]->value)
     return {};
 
-  TypeSubst leftSubst;
-  checker.subst.swap(leftSubst);
+  Compose(valueSubst, checker.subst);
+  Compose(Unify(*args[0]->value->type, *args[1]->value->type), checker.subst);
+  return value;
+}
 
-  checker.Visit(right.get());
-  if(!right->value)
+template<bool isLeft>
+void BRotate<isLeft>::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  auto& builder = compiler.builder;
+
+  compiler.Visit(args[0].get());
+  auto value = compiler.Load(compiler.result);
+  compiler.Visit(args[1].get());
+  auto amount = compiler.Load(compiler.result);
+
+  auto type = value->getType();
+  auto mask = llvm::ConstantInt::get(type, type->getIntegerBitWidth() - 1);
+  auto there = builder.CreateAnd(amount, mask);
+  auto back = builder.CreateAnd(builder.CreateNeg(amount), mask);
+
+  if(isLeft)
+    compiler.result = builder.CreateOr(builder.CreateShl(value, there), builder.CreateLShr(value, back), "rotl");
+  else
+    compiler.result = builder.CreateOr(builder.CreateLShr(value, there), builder.CreateShl(value, back), "rotr");
+}
+
+template<bool isLeft>
+bool BRotate<isLeft>::CanSpeculate(const vector<ExprPtr>& args, int& budget)
+{
+  return --budget >= 0 && xra::CanSpeculate(*args[0], budget) && xra::CanSpeculate(*args[1], budget);
+}
+
+/*
+ * String builtins: len, ++ and slice
+ *
+ * A string's length is a field, so len costs nothing, and a slice shares
+ * the data of the string it is taken from. Concatenation allocates with
+ * xra_alloc (from the current region, if any) unless one side is empty.
+ */
+
+// infers each argument and unifies it with the type expected of it
+static bool InferArguments(TypeChecker& checker, const vector<ExprPtr>& args, const vector<TypePtr>& types)
+{
+  for(size_t i = 0; i < args.size(); i++)
+  {
+    TypeSubst lastSubst;
+    checker.subst.swap(lastSubst);
+
+    checker.Visit(args[i].get());
+    if(!args[i]->value)
+      return false;
+
+    Compose(lastSubst, checker.subst);
+    if(types[i])
+      Compose(Unify(*args[i]->value->type, *types[i]), checker.subst);
+  }
+  return !Diagnostics::Current().Aborted();
+}
+
+class BStringLength : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+  bool CanSpeculate(const vector<ExprPtr>&, int& budget);
+  bool IsPure() const { return true; }
+};
+
+ValuePtr BStringLength::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  if(args.size() != 1) {
+    Error() << "len takes one argument";
+    return {};
+  }
+  if(!InferArguments(checker, args, {StringType}))
     return {};
 
-  Compose(leftSubst, checker.subst);
-  Compose(Unify(*left->value->type, *right->value->type), checker.subst);
+  ValuePtr value = new VTemporary;
+  value->type = IntegerType;
+  return value;
+}
 
-  auto type = left->value->type.get();
-  if(!isa<TInteger>(type) && !isa<TFloat>(type)) {
-    Error() << "Arithmetic operation requires float or integer operands";
+void BStringLength::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  compiler.Visit(args[0].get());
+  auto length = CreateStringLength(compiler, compiler.Load(compiler.result));
+  compiler.result = compiler.builder.CreateTrunc(length, ToLLVM(*IntegerType, compiler.module.getContext()));
+}
+
+bool BStringLength::CanSpeculate(const vector<ExprPtr>& args, int& budget)
+{
+  return --budget >= 0 && xra::CanSpeculate(*args[0], budget);
+}
+
+class BConcat : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+  bool IsPure() const { return true; }
+};
+
+ValuePtr BConcat::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  if(args.size() != 2) {
+    Error() << "Binary operator requires two operands";
     return {};
   }
+  if(!InferArguments(checker, args, {StringType, StringType}))
+    return {};
 
   ValuePtr value = new VTemporary;
-  value->type = ResultType<typename Operation::IsCompare>(type);
+  value->type = StringType;
   return value;
 }
 
-template<class Operation>
-void BArithmetic<Operation>::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+void BConcat::Compile(Compiler& compiler, const vector<ExprPtr>& args)
 {
-  assert(args.size() == 2);
+  auto& builder = compiler.builder;
 
   compiler.Visit(args[0].get());
   auto left = compiler.Load(compiler.result);
-
   compiler.Visit(args[1].get());
   auto right = compiler.Load(compiler.result);
 
-  if(isa<TInteger>(args[0]->value->type.get()))
-    compiler.result = Operation::IntOp(compiler.builder, left, right);
-  else
-    compiler.result = Operation::FloatOp(compiler.builder, left, right);
+  auto leftLength = CreateStringLength(compiler, left);
+  auto rightLength = CreateStringLength(compiler, right);
+
+  auto concat = GetStringRuntime(compiler, "xra_string_concat", builder.getInt8PtrTy(), 2);
+  vector<llvm::Value*> concatArgs{CreateStringData(compiler, left), leftLength,
+                                  CreateStringData(compiler, right), rightLength};
+  auto data = builder.CreateCall(concat, concatArgs, "concat");
+  compiler.result = compiler.MakeString(data, builder.CreateNUWAdd(leftLength, rightLength));
+}
+
+class BSlice : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+  bool CanSpeculate(const vector<ExprPtr>&, int& budget);
+  bool IsPure() const { return true; }
+};
+
+ValuePtr BSlice::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  if(args.size() != 3) {
+    Error() << "slice takes three arguments";
+    return {};
+  }
+  if(!InferArguments(checker, args, {StringType, nullptr, nullptr}))
+    return {};
+
+  for(size_t i = 1; i < args.size(); i++) {
+    if(!isa<TInteger>(xra::Apply(checker.subst, *args[i]->value->type).get())) {
+      Error() << "slice requires integer bounds";
+      return {};
+    }
+  }
+
+  ValuePtr value = new VTemporary;
+  value->type = StringType;
+  return value;
+}
+
+// bounds are clamped to the string, and a slice ending before it starts is empty
+void BSlice::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  auto& builder = compiler.builder;
+
+  compiler.Visit(args[0].get());
+  auto str = compiler.Load(compiler.result);
+  auto length = CreateStringLength(compiler, str);
+
+  llvm::Value* bounds[2];
+  for(size_t i = 0; i < 2; i++) {
+    compiler.Visit(args[i + 1].get());
+    auto bound = compiler.Load(compiler.result);
+    bool isSigned = static_cast<TInteger&>(*args[i + 1]->value->type)._signed;
+    bound = builder.CreateIntCast(bound, builder.getInt64Ty(), isSigned);
+
+    if(isSigned) {
+      auto zero = builder.getInt64(0);
+      bound = builder.CreateSelect(builder.CreateICmpSLT(bound, zero), zero, bound);
+    }
+    bounds[i] = builder.CreateSelect(builder.CreateICmpUGT(bound, length), length, bound);
+  }
+
+  auto from = bounds[0];
+  auto to = builder.CreateSelect(builder.CreateICmpULT(bounds[1], from), from, bounds[1]);
+  auto data = builder.CreateGEP(CreateStringData(compiler, str), from);
+  compiler.result = compiler.MakeString(data, builder.CreateSub(to, from));
+}
+
+bool BSlice::CanSpeculate(const vector<ExprPtr>& args, int& budget)
+{
+  return --budget >= 0 && xra::CanSpeculate(*args[0], budget) &&
+    xra::CanSpeculate(*args[1], budget) && xra::CanSpeculate(*args[2], budget);
+}
+
+/*
+ * BInterpolate: "...{x}..."
+ *
+ * The arguments alternate between the text around the slots and the slots
+ * themselves. The result is built in one allocation sized from the text's
+ * length and the widest each slot can format to, and every slot is
+ * formatted straight into its place.
+ */
+
+class BInterpolate : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+  bool IsPure() const { return true; }
+};
+
+// characters xra_format_float writes at most
+static const uint64_t MaxFloatWidth = 24;
+
+// characters the decimal form of an integer of the type takes at most
+static uint64_t MaxIntegerWidth(const TInteger& type)
+{
+  uint64_t magnitude = type._signed ? uint64_t(1) << (type.width - 1)
+    : type.width == 64 ? ~uint64_t(0) : (uint64_t(1) << type.width) - 1;
+
+  uint64_t width = type._signed ? 1 : 0;
+  do {
+    width++;
+    magnitude /= 10;
+  } while(magnitude);
+  return width;
+}
+
+ValuePtr BInterpolate::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  assert(args.size() % 2 == 1);
+
+  if(!InferArguments(checker, args, vector<TypePtr>(args.size())))
+    return {};
+
+  for(size_t i = 1; i < args.size(); i += 2) {
+    auto type = xra::Apply(checker.subst, *args[i]->value->type);
+    auto intType = dyn_cast<TInteger>(type.get());
+    if(intType ? intType->width > 64 : !isa<TFloat>(type.get()) && !isa<TBoolean>(type.get()) && !isa<TString>(type.get())) {
+      Error() << "Cannot interpolate a value of type " << *type;
+      return {};
+    }
+    args[i]->value->type = type;
+  }
+
+  ValuePtr value = new VTemporary;
+  value->type = StringType;
+  return value;
+}
+
+void BInterpolate::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  auto& builder = compiler.builder;
+  auto int64 = builder.getInt64Ty();
+
+  // every slot is evaluated before the buffer is sized
+  vector<llvm::Value*> slots;
+  uint64_t fixedSize = 0;
+  llvm::Value* size = nullptr;
+  for(size_t i = 0; i < args.size(); i++) {
+    if(i % 2 == 0) {
+      fixedSize += static_cast<const EString&>(*args[i]).literal.size();
+      continue;
+    }
+
+    compiler.Visit(args[i].get());
+    auto slot = compiler.Load(compiler.result);
+    slots.push_back(slot);
+
+    auto type = args[i]->value->type.get();
+    if(auto intType = dyn_cast<TInteger>(type))
+      fixedSize += MaxIntegerWidth(*intType);
+    else if(isa<TFloat>(type))
+      fixedSize += MaxFloatWidth;
+    else if(isa<TBoolean>(type))
+      fixedSize += strlen("false");
+    else {
+      auto length = CreateStringLength(compiler, slot);
+      size = size ? builder.CreateNUWAdd(size, length) : length;
+    }
+  }
+
+  // one more byte for the NUL
+  auto fixed = builder.getInt64(fixedSize + 1);
+  size = size ? builder.CreateNUWAdd(size, fixed) : fixed;
+  auto buffer = compiler.CreateAlloc(size, "interp");
+
+  llvm::Value* position = builder.getInt64(0);
+  auto append = [&](llvm::Value* data, llvm::Value* length) {
+    builder.CreateMemCpy(builder.CreateGEP(buffer, position), data, length, 1);
+    position = builder.CreateNUWAdd(position, length);
+  };
+
+  for(size_t i = 0; i < args.size(); i++) {
+    if(i % 2 == 0) {
+      auto& literal = static_cast<const EString&>(*args[i]).literal;
+      if(!literal.empty())
+        append(builder.CreateGlobalStringPtr(literal, "EString"), builder.getInt64(literal.size()));
+      continue;
+    }
+
+    auto slot = slots[i / 2];
+    auto out = builder.CreateGEP(buffer, position);
+    auto type = args[i]->value->type.get();
+    if(auto intType = dyn_cast<TInteger>(type)) {
+      auto value = builder.CreateIntCast(slot, int64, intType->_signed);
+      auto format = intType->_signed ? "xra_format_int" : "xra_format_uint";
+      vector<llvm::Type*> params{builder.getInt8PtrTy(), int64};
+      auto formatType = llvm::FunctionType::get(int64, params, false);
+      vector<llvm::Value*> formatArgs{out, value};
+      auto length = builder.CreateCall(compiler.module.getOrInsertFunction(format, formatType), formatArgs, "len");
+      position = builder.CreateNUWAdd(position, length);
+    }
+    else if(isa<TFloat>(type)) {
+      auto value = builder.CreateFPCast(slot, builder.getDoubleTy());
+      vector<llvm::Type*> params{builder.getInt8PtrTy(), builder.getDoubleTy()};
+      auto formatType = llvm::FunctionType::get(int64, params, false);
+      vector<llvm::Value*> formatArgs{out, value};
+      auto length = builder.CreateCall(compiler.module.getOrInsertFunction("xra_format_float", formatType), formatArgs, "len");
+      position = builder.CreateNUWAdd(position, length);
+    }
+    else if(isa<TBoolean>(type)) {
+      auto data = builder.CreateSelect(slot, builder.CreateGlobalStringPtr("true", "EString"),
+                                       builder.CreateGlobalStringPtr("false", "EString"));
+      append(data, builder.CreateSelect(slot, builder.getInt64(4), builder.getInt64(5)));
+    }
+    else {
+      append(CreateStringData(compiler, slot), CreateStringLength(compiler, slot));
+    }
+  }
+
+  builder.CreateStore(builder.getInt8(0), builder.CreateGEP(buffer, position));
+  compiler.result = compiler.MakeString(buffer, position);
+}
+
+/*
+ * BFastMath
+ */
+
+class BFastMath : public VBuiltin
+{
+public:
+  ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&);
+  void Compile(Compiler&, const vector<ExprPtr>&);
+  bool IsPure() const { return true; }
+};
+
+ValuePtr BFastMath::Infer(TypeChecker& checker, const vector<ExprPtr>& args)
+{
+  if(args.size() != 1) {
+    Error() << "fastmath takes one argument";
+    return {};
+  }
+
+  checker.Visit(args[0].get());
+  return args[0]->value;
+}
+
+// float operations in the operand, including the bodies of functions it
+// creates, may be reassociated, contracted and assumed finite
+void BFastMath::Compile(Compiler& compiler, const vector<ExprPtr>& args)
+{
+  bool tail = compiler.tailPosition;
+  bool previousFastMath = compiler.fastMath;
+  compiler.fastMath = true;
+  compiler.Visit(args[0].get(), tail);
+  compiler.fastMath = previousFastMath;
 }
 
 void AddBuiltins(Env& env)
@@ -528,8 +2306,14 @@ void AddBuiltins(Env& env)
   env.AddValue("=", new BAssign);
   env.AddValue("#if", new BIf);
   env.AddValue("#while", new BWhile);
+  env.AddValue("#for", new BFor);
+  env.AddValue("#parallel", new BParallel);
+  env.AddValue("&&", new BLogical<true>);
+  env.AddValue("||", new BLogical<false>);
   env.AddValue("#return", new BReturn);
   env.AddValue("#break", new BBreak);
+  env.AddValue("#yield", new BYield);
+  env.AddValue("#region", new BRegion);
   env.AddValue("#module", new BModule);
   env.AddValue("#using", new BUsing);
   env.AddValue("+", new BArithmetic<Add>);
@@ -537,12 +2321,35 @@ void AddBuiltins(Env& env)
   env.AddValue("*", new BArithmetic<Mul>);
   env.AddValue("/", new BArithmetic<Div>);
   env.AddValue("%", new BArithmetic<Rem>);
+  env.AddValue("+%", new BArithmetic<WrapAdd>);
+  env.AddValue("-%", new BArithmetic<WrapSub>);
+  env.AddValue("*%", new BArithmetic<WrapMul>);
+  env.AddValue("+!", new BArithmetic<CheckedAdd>);
+  env.AddValue("-!", new BArithmetic<CheckedSub>);
+  env.AddValue("*!", new BArithmetic<CheckedMul>);
   env.AddValue("==", new BArithmetic<EQ>);
   env.AddValue("!=", new BArithmetic<NE>);
   env.AddValue("<", new BArithmetic<LT>);
   env.AddValue("<=", new BArithmetic<LE>);
   env.AddValue(">", new BArithmetic<GT>);
   env.AddValue(">=", new BArithmetic<GE>);
+  env.AddValue("&", new BArithmetic<And>);
+  env.AddValue("|", new BArithmetic<Or>);
+  env.AddValue("^", new BArithmetic<Xor>);
+  env.AddValue("<<", new BArithmetic<Shl>);
+  env.AddValue(">>", new BArithmetic<Shr>);
+  env.AddValue("~", new BComplement);
+  env.AddValue("++", new BConcat);
+  env.AddValue("len", new BStringLength);
+  env.AddValue("slice", new BSlice);
+  env.AddValue("#interpolate", new BInterpolate);
+  env.AddValue("popcount", new BBitIntrinsic("popcount", llvm::Intrinsic::ctpop, false));
+  env.AddValue("clz", new BBitIntrinsic("clz", llvm::Intrinsic::ctlz, true));
+  env.AddValue("ctz", new BBitIntrinsic("ctz", llvm::Intrinsic::cttz, true));
+  env.AddValue("bswap", new BBitIntrinsic("bswap", llvm::Intrinsic::bswap, false));
+  env.AddValue("rotl", new BRotate<true>);
+  env.AddValue("rotr", new BRotate<false>);
+  env.AddValue("fastmath", new BFastMath);
 }
 
 } // namespace xra
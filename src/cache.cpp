@@ -0,0 +1,191 @@
+#include "common.hpp"
+#include "backend.hpp"
+#include <llvm/Support/Host.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+namespace xra {
+
+/*
+ * Compiled modules are cached as shared objects named after a hash of the
+ * unoptimized IR and everything else that affects code generation. Entries
+ * are written under a temporary name and renamed into place, so concurrent
+ * processes never see a partial file. A hit refreshes the entry's mtime,
+ * which eviction uses as the LRU order; the entry just stored is kept even
+ * if it alone exceeds the limit, and stale temporary files are removed.
+ */
+
+static const char* const CacheVersion = "xra-cache-1";
+
+// temporary files this old were left by a link that crashed or was killed
+static const time_t StaleTempSeconds = 60 * 60;
+
+static uint64_t HashBytes(uint64_t hash, const string& bytes)
+{
+  for(char c : bytes) {
+    hash ^= (unsigned char)c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+string HashModule(const llvm::Module& module, const BackendOptions& options)
+{
+  string key;
+  llvm::raw_string_ostream os(key);
+  os << CacheVersion << "\n";
+  os << llvm::sys::getDefaultTargetTriple() << "\n";
+  os << GetTargetCPU(options) << "\n";
+  for(auto& feature : GetTargetFeatures(options))
+    os << feature << ",";
+  os << "\n";
+
+  os << "-O" << options.optLevel << (options.fastMath ? " -ffast-math" : "")
+     << " -fspecialize-budget=" << options.specializeBudget << "\n";
+
+  // the module is named after the source path, which does not affect the code
+  string ir;
+  llvm::raw_string_ostream iros(ir);
+  module.print(iros, nullptr);
+  iros.flush();
+  if(ir.compare(0, 11, "; ModuleID ") == 0)
+    ir.erase(0, ir.find('\n') + 1);
+  os << ir;
+  os.flush();
+
+  // two independent 64-bit FNV-1a hashes make a 128-bit key
+  char hex[33];
+  snprintf(hex, sizeof(hex), "%016llx%016llx",
+           (unsigned long long)HashBytes(0xcbf29ce484222325ULL, key),
+           (unsigned long long)HashBytes(0x84222325cbf29ce4ULL, key));
+  return hex;
+}
+
+// removes the least recently used entries other than keep until the cache fits the limit
+static void Evict(const string& dir, size_t limit, const string& keep)
+{
+  struct Entry {
+    string path;
+    time_t mtime;
+    size_t size;
+  };
+
+  DIR* d = opendir(dir.c_str());
+  if(!d)
+    return;
+
+  vector<Entry> entries;
+  size_t total = 0;
+  time_t now = time(nullptr);
+  while(auto ent = readdir(d)) {
+    string name = ent->d_name;
+    bool temporary = name.compare(0, 4, "tmp-") == 0;
+    if(!temporary && (name.size() < 3 || name.compare(name.size() - 3, 3, ".so") != 0))
+      continue;
+
+    struct stat st;
+    string path = dir + "/" + name;
+    if(stat(path.c_str(), &st) != 0)
+      continue;
+
+    if(temporary) {
+      if(now - st.st_mtime > StaleTempSeconds)
+        unlink(path.c_str());
+      continue;
+    }
+
+    total += (size_t)st.st_size;
+    if(path != keep)
+      entries.push_back({path, st.st_mtime, (size_t)st.st_size});
+  }
+  closedir(d);
+
+  sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+    return a.mtime < b.mtime;
+  });
+
+  for(auto& entry : entries) {
+    if(total <= limit)
+      break;
+    // another process may have removed it already
+    unlink(entry.path.c_str());
+    total -= entry.size;
+  }
+}
+
+static bool Store(const llvm::Module& module, const string& path, const BackendOptions& options, string& err)
+{
+  auto& dir = options.cacheDir;
+
+  string objectPath = dir + "/tmp-XXXXXX.o";
+  int fd = mkstemps(&objectPath[0], 2);
+  if(fd < 0) {
+    err = "could not create temporary file in " + dir;
+    return false;
+  }
+  close(fd);
+
+  string tempPath = dir + "/tmp-XXXXXX";
+  fd = mkstemp(&tempPath[0]);
+  if(fd < 0) {
+    unlink(objectPath.c_str());
+    err = "could not create temporary file in " + dir;
+    return false;
+  }
+  close(fd);
+
+  // the caller falls back to the JIT on failure, which optimizes the original
+  unique_ptr<llvm::Module> copy(llvm::CloneModule(&module));
+  Optimize(*copy, options);
+
+  bool ok = EmitObjectFile(*copy, objectPath, options, err) &&
+    LinkSharedObject(objectPath, tempPath, err);
+  unlink(objectPath.c_str());
+
+  if(ok && rename(tempPath.c_str(), path.c_str()) != 0) {
+    err = "could not rename " + tempPath + " to " + path;
+    ok = false;
+  }
+  if(!ok)
+    unlink(tempPath.c_str());
+
+  return ok;
+}
+
+void* LoadCachedFunction(const llvm::Module& module, const string& name, const BackendOptions& options, bool& hit, string& err)
+{
+  auto& dir = options.cacheDir;
+  mkdir(dir.c_str(), 0755);
+
+  string path = dir + "/" + HashModule(module, options) + ".so";
+
+  hit = access(path.c_str(), R_OK) == 0;
+  if(hit) {
+    utime(path.c_str(), nullptr);
+  }
+  else {
+    if(!Store(module, path, options, err))
+      return nullptr;
+    Evict(dir, options.cacheLimit, path);
+  }
+
+  void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if(!handle) {
+    err = dlerror();
+    return nullptr;
+  }
+
+  void* func = dlsym(handle, name.c_str());
+  if(!func)
+    err = "cached object has no symbol " + name;
+  return func;
+}
+
+} // namespace xra
@@ -0,0 +1,173 @@
+#include "common.hpp"
+#include "compiler.hpp"
+
+namespace xra {
+
+/*
+ * Escape analysis for closures. A closure escapes unless it is called on the
+ * spot or stored in a local of the creating function that is only ever
+ * called. A variable stops qualifying once an escaping closure captures it,
+ * since that closure could call it later, so this runs to a fixpoint. A local
+ * copied into another escapes when the copy does.
+ * Locals captured by an escaping closure are boxed on the heap; everything
+ * else stays in the frame, and so do the environments of non-escaping
+ * closures.
+ *
+ * The same walk finds locals that are assigned exactly once; calls through
+ * those assigned a function literal are compiled as direct calls.
+ */
+
+namespace {
+
+class ClosureAnalysis : public Visitor<ClosureAnalysis, Expr>
+{
+public:
+  enum Use { UseValue, UseCallee, UseStored };
+
+  struct Closure
+  {
+    EFunction* function;
+    VLocal* storedIn;
+    bool escapes;
+  };
+
+  ClosureAnalysis() :
+    function(nullptr),
+    use(UseValue),
+    target(nullptr)
+  {}
+
+  void Visit(Base* node, Use use_ = UseValue, VLocal* target_ = nullptr)
+  {
+    use = use_;
+    target = target_;
+    base::Visit(node);
+  }
+
+  void VisitEVariable(EVariable& expr)
+  {
+    auto local = dyn_cast_or_null<VLocal>(expr.value.get());
+    if(!local || use == UseCallee)
+      return;
+
+    if(use == UseStored && target)
+      copies.push_back({local, target});
+    else
+      escapingLocals.insert(local);
+  }
+
+  void VisitEFunction(EFunction& expr)
+  {
+    if(function) {
+      // a for's body is only ever called by the generator it is passed to
+      bool escapes = !expr.loopBody && ((use == UseValue) || (use == UseStored && !target));
+      closures.push_back({&expr, target, escapes});
+
+      for(auto& capture : expr.captures) {
+        if(capture.local->owner == function)
+          function->captured.insert(capture.name);
+      }
+    }
+
+    auto previousFunction = function;
+    function = &expr;
+    Visit(expr.body.get());
+    function = previousFunction;
+  }
+
+  void VisitECall(ECall& expr)
+  {
+    auto var = dyn_cast<EVariable>(expr.function.get());
+    if(var && var->name == "=" && isa<VBuiltin>(var->value.get())) {
+      auto& args = static_cast<EList&>(*expr.argument).exprs;
+
+      // only a local of this frame can keep a closure from escaping
+      VLocal* local = nullptr;
+      if(isa<EVariable>(args[0].get()))
+        local = dyn_cast_or_null<VLocal>(args[0]->value.get());
+      else
+        Visit(args[0].get());
+
+      if(local) {
+        assignments[local]++;
+        bindings[local] = dyn_cast<EFunction>(Unannotated(args[1].get()));
+      }
+
+      if(local && local->owner != function)
+        local = nullptr;
+
+      Visit(args[1].get(), UseStored, local);
+      return;
+    }
+
+    // a parallel loop's body only runs while the loop does
+    if(var && var->name == "#parallel" && isa<VBuiltin>(var->value.get())) {
+      auto& args = static_cast<EList&>(*expr.argument).exprs;
+      for(size_t i = 0; i < args.size() - 1; i++)
+        Visit(args[i].get());
+      Visit(args.back().get(), UseCallee);
+      return;
+    }
+
+    Visit(expr.function.get(), UseCallee);
+    Visit(expr.argument.get());
+  }
+
+  void Solve()
+  {
+    bool changed = true;
+    while(changed) {
+      changed = false;
+
+      for(auto& copy : copies) {
+        if(escapingLocals.count(copy.second) && escapingLocals.insert(copy.first).second)
+          changed = true;
+      }
+
+      for(auto& closure : closures) {
+        if(!closure.escapes && closure.storedIn && escapingLocals.count(closure.storedIn)) {
+          closure.escapes = true;
+          changed = true;
+        }
+        if(!closure.escapes)
+          continue;
+
+        for(auto& capture : closure.function->captures) {
+          capture.local->owner->boxed.insert(capture.name);
+          if(escapingLocals.insert(capture.local).second)
+            changed = true;
+        }
+      }
+    }
+
+    for(auto& closure : closures)
+      closure.function->escapes = closure.escapes;
+
+    for(auto& binding : bindings) {
+      binding.first->assignedOnce = !binding.first->param && assignments[binding.first] == 1;
+      if(binding.second && binding.first->assignedOnce)
+        binding.first->function = binding.second;
+    }
+  }
+
+private:
+  EFunction* function;
+  Use use;
+  VLocal* target;
+  vector<Closure> closures;
+  set<VLocal*> escapingLocals;
+  vector<pair<VLocal*, VLocal*>> copies; // source, local it was copied into
+  map<VLocal*, unsigned int> assignments;
+  map<VLocal*, EFunction*> bindings;
+};
+
+} // namespace
+
+void AnalyzeClosures(Expr& root)
+{
+  ClosureAnalysis analysis;
+  analysis.Visit(&root);
+  analysis.Solve();
+}
+
+} // namespace xra
@@ -3,7 +3,115 @@
 
 namespace xra {
 
-stringstream Error::ss;
+thread_local Diagnostics* Diagnostics::current = nullptr;
+thread_local const SourceLoc* Diagnostics::context = nullptr;
+
+const char* Diagnostics::Record::Id() const
+{
+  for(auto& piece : pieces) {
+    if(piece.literal)
+      return piece.literal;
+  }
+  return "";
+}
+
+void Diagnostics::Add(Record&& record, const SourceLoc& recordLoc)
+{
+  auto& loc = (!recordLoc.source && context) ? *context : recordLoc;
+  bool isError = (record.severity == Severity_Error);
+
+  if(isError && errorLimit != 0 &&
+     errorCount.fetch_add(1, memory_order_relaxed) >= errorLimit) {
+    lock_guard<mutex> lock(recordsMutex);
+    dropped++;
+    return;
+  }
+
+  lock_guard<mutex> lock(recordsMutex);
+
+  record.source = 0;
+  if(loc.source) {
+    for(size_t i = 1; i < sources.size(); i++) {
+      if(sources[i] == loc.source) {
+        record.source = (uint16_t)i;
+        break;
+      }
+    }
+    if(record.source == 0 && sources.size() <= UINT16_MAX) {
+      record.source = (uint16_t)sources.size();
+      sources.push_back(loc.source);
+    }
+  }
+  record.line = (uint32_t)max(loc.line, 0);
+  record.column = (uint16_t)min(max(loc.column, 0), (int)UINT16_MAX);
+
+  if(isError && errorLimit == 0)
+    errorCount.fetch_add(1, memory_order_relaxed);
+
+  records.push_back(move(record));
+}
+
+void Diagnostics::Flush(ostream& os)
+{
+  lock_guard<mutex> lock(recordsMutex);
+
+  for(auto& record : records)
+  {
+    if(record.source != 0)
+      os << *sources[record.source] << ":" << record.line << ":" << record.column << ": ";
+
+    if(record.severity == Severity_Warning)
+      os << "warning: ";
+    else if(record.severity == Severity_Note)
+      os << "note: ";
+
+    for(auto& piece : record.pieces) {
+      if(piece.literal)
+        os << piece.literal;
+      else
+        piece.argument->Print(os);
+    }
+    os << endl;
+  }
+
+  if(dropped > 0)
+    os << "too many errors, " << dropped << " more not shown" << endl;
+  else if(Aborted())
+    os << "too many errors, stopping" << endl;
+
+  records.clear();
+  dropped = 0;
+}
+
+Diagnostics& Diagnostics::Current()
+{
+  static Diagnostics fallback(0);
+  return current ? *current : fallback;
+}
+
+Diagnostics::Scope::Scope(Diagnostics& diags) :
+  previous(current)
+{
+  current = &diags;
+}
+
+Diagnostics::Scope::~Scope()
+{
+  current = previous;
+}
+
+Diagnostics::Context::Context(const SourceLoc& loc) :
+  previous(context)
+{
+  // constructs the parser made up have no location of their own
+  if(loc.source)
+    context = &loc;
+}
+
+Diagnostics::Context::~Context()
+{
+  context = previous;
+}
 
 ostream& operator<<(ostream& os, const SourceLoc& loc)
 {
@@ -9,6 +9,7 @@ using namespace std;
 
 using llvm::isa;
 using llvm::dyn_cast;
+using llvm::dyn_cast_or_null;
 
 template<typename T, typename... Args>
 unique_ptr<T> make_unique(Args&&... args)
@@ -23,6 +24,8 @@ struct SourceLoc
   int column;
 };
 
+class Base;
+
 class Expr;
 typedef boost::intrusive_ptr<Expr> ExprPtr;
 
@@ -41,34 +44,179 @@ class TypeChecker;
 class Compiler;
 class Env;
 
+/*
+ * Diagnostics collects the errors and warnings of one compilation unit as
+ * structured records. Records keep string literals by pointer and every
+ * other argument as a typed value (expressions, types and values by
+ * reference); nothing is formatted until Flush prints the record. A record
+ * made without a location takes the innermost one a Context provides.
+ */
+class Diagnostics
+{
+public:
+  enum Severity {
+    Severity_Note,
+    Severity_Warning,
+    Severity_Error
+  };
+
+  // an argument kept for printing
+  struct Argument
+  {
+    virtual ~Argument() {}
+    virtual void Print(ostream&) const = 0;
+  };
+
+  struct Piece
+  {
+    const char* literal; // non-null for string literals
+    shared_ptr<const Argument> argument;
+  };
+
+  struct Record
+  {
+    Severity severity;
+    uint16_t source; // index into sources, 0 if unknown
+    uint16_t column;
+    uint32_t line;
+    vector<Piece> pieces;
+
+    // the first literal streamed into the record
+    const char* Id() const;
+  };
+
+  explicit Diagnostics(size_t errorLimit_ = 20) :
+    errorCount(0),
+    errorLimit(errorLimit_),
+    dropped(0)
+  {
+    sources.emplace_back();
+  }
+
+  void Add(Record&&, const SourceLoc&);
+
+  // prints and discards all pending records
+  void Flush(ostream&);
+
+  size_t ErrorCount() const
+  {
+    return errorCount.load(memory_order_relaxed);
+  }
+
+  // true once the error limit has been reached; further errors are dropped
+  bool Aborted() const
+  {
+    return errorLimit != 0 && ErrorCount() >= errorLimit;
+  }
+
+  void SetErrorLimit(size_t limit)
+  {
+    errorLimit = limit;
+  }
+
+  // the sink installed on this thread, or a process-wide fallback
+  static Diagnostics& Current();
+
+  class Scope
+  {
+    Diagnostics* previous;
+
+  public:
+    Scope(Diagnostics& diags);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+  };
+
+  // the location of the construct being checked on this thread
+  class Context
+  {
+    const SourceLoc* previous;
+
+  public:
+    Context(const SourceLoc& loc);
+    ~Context();
+
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+  };
+
+  Diagnostics(const Diagnostics&) = delete;
+  Diagnostics& operator=(const Diagnostics&) = delete;
+
+private:
+  mutex recordsMutex;
+  vector<Record> records;
+  vector<shared_ptr<string>> sources;
+  atomic<size_t> errorCount;
+  size_t errorLimit;
+  size_t dropped;
+
+  static thread_local Diagnostics* current;
+  static thread_local const SourceLoc* context;
+};
+
+// copies of plain values; C strings are copied as strings
+template<class T, bool shared = is_base_of<Base, T>::value>
+struct DiagnosticArgument : Diagnostics::Argument
+{
+  typedef typename conditional<is_same<T, const char*>::value || is_same<T, char*>::value, string, T>::type Stored;
+  Stored value;
+
+  DiagnosticArgument(const T& value_) : value(value_) {}
+  void Print(ostream& os) const { os << value; }
+};
+
+// expressions, types and values are kept alive rather than copied
+template<class T>
+struct DiagnosticArgument<T, true> : Diagnostics::Argument
+{
+  boost::intrusive_ptr<T> value;
+
+  DiagnosticArgument(const T& value_) : value(const_cast<T*>(&value_)) {}
+  void Print(ostream& os) const { os << *value; }
+};
+
 class Error
 {
 public:
-  Error()
-  {}
+  Error(Diagnostics::Severity severity = Diagnostics::Severity_Error)
+  {
+    record.severity = severity;
+  }
+
+  Error(const SourceLoc& loc_, Diagnostics::Severity severity = Diagnostics::Severity_Error) :
+    loc(loc_)
+  {
+    record.severity = severity;
+  }
 
   ~Error()
   {
-    ss << endl;
+    Diagnostics::Current().Add(move(record), loc);
   }
 
-  template<class T>
-  Error& operator<<(T&& value)
+  template<size_t N>
+  Error& operator<<(const char (&literal)[N])
   {
-    ss << forward<T>(value);
+    record.pieces.push_back({literal, nullptr});
     return *this;
   }
 
-  static string Get()
+  template<class T>
+  Error& operator<<(const T& value)
   {
-    return ss.str();
+    record.pieces.push_back({nullptr, make_shared<DiagnosticArgument<T>>(value)});
+    return *this;
   }
 
   Error(const Error&) = delete;
   Error& operator=(const Error&) = delete;
 
 private:
-  static stringstream ss;
+  Diagnostics::Record record;
+  SourceLoc loc;
 };
 
 template<class C>
@@ -19,11 +19,18 @@
 #include <llvm/ExecutionEngine/JIT.h>
 #include <boost/intrusive_ptr.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <stack>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 #endif // XRA_COMMON_SYSTEM_HPP
@@ -4,20 +4,295 @@
 
 namespace xra {
 
+/*
+ * Stack slots always go at the start of the entry block, so they are created
+ * once per call rather than once per loop iteration, and mem2reg can promote them.
+ */
+llvm::AllocaInst* Compiler::CreateEntryAlloca(llvm::Type* type, const llvm::Twine& name)
+{
+  auto& entryBlock = builder.GetInsertBlock()->getParent()->getEntryBlock();
+  llvm::IRBuilder<> entryBuilder(&entryBlock, entryBlock.begin());
+  auto slot = entryBuilder.CreateAlloca(type, nullptr, name);
+  slots.insert(slot);
+  return slot;
+}
+
+/*
+ * Heap values come from the innermost region active on the thread when
+ * they are allocated (runtime-arena.cpp), or from malloc outside of one.
+ */
+llvm::Value* Compiler::CreateAlloc(llvm::Value* size, const llvm::Twine& name)
+{
+  vector<llvm::Type*> allocParams{builder.getInt64Ty()};
+  auto allocType = llvm::FunctionType::get(builder.getInt8PtrTy(), allocParams, false);
+  return builder.CreateCall(module.getOrInsertFunction("xra_alloc", allocType), size, name);
+}
+
+llvm::Value* Compiler::CreateHeapAlloc(llvm::Type* type, const llvm::Twine& name)
+{
+  auto memory = CreateAlloc(llvm::ConstantExpr::getSizeOf(type));
+  return builder.CreateBitCast(memory, type->getPointerTo(), name);
+}
+
+// calls xra_region_push or xra_region_pop
+void Compiler::CreateRegionCall(const char* name)
+{
+  auto type = llvm::FunctionType::get(builder.getVoidTy(), false);
+  builder.CreateCall(module.getOrInsertFunction(name, type));
+}
+
+// pops the regions entered since regionDepth was depth, before a jump out of them
+void Compiler::LeaveRegions(unsigned int depth)
+{
+  for(unsigned int i = depth; i < regionDepth; i++)
+    CreateRegionCall("xra_region_pop");
+}
+
+/*
+ * Locals captured by escaping closures live in heap boxes instead of stack
+ * slots; like stack slots, they are allocated once per call.
+ */
+llvm::Value* Compiler::CreateEntrySlot(llvm::Type* type, const string& name, bool boxed)
+{
+  if(!boxed)
+    return CreateEntryAlloca(type, name);
+
+  auto ip = builder.saveIP();
+  auto& entryBlock = builder.GetInsertBlock()->getParent()->getEntryBlock();
+  builder.SetInsertPoint(&entryBlock, entryBlock.begin());
+  auto slot = CreateHeapAlloc(type, name);
+  builder.restoreIP(ip);
+
+  slots.insert(slot);
+  return slot;
+}
+
+/*
+ * Environments hold pointers to the captured variables, so closures and the
+ * frame that created them see each other's assignments.
+ */
+llvm::Value* Compiler::GetSlot(const EFunction::Capture& capture)
+{
+  bool boxed = function && function->boxed.count(capture.name);
+
+  auto& value = values[capture.name];
+  if(!value)
+    return value = CreateEntrySlot(ToLLVM(*capture.local->type, module.getContext()), capture.name, boxed);
+  if(slots.count(value))
+    return value;
+
+  // the function's own closure is an SSA value; give it a slot to point to
+  auto slot = CreateEntrySlot(value->getType(), capture.name, boxed);
+  builder.CreateStore(value, slot);
+  return value = slot;
+}
+
+/*
+ * A closure is a {code, env} pair. The code takes the environment as a
+ * trailing i8* parameter; functions that capture nothing get a null one.
+ */
+llvm::Value* Compiler::MakeClosure(llvm::Function* code, llvm::Value* env)
+{
+  vector<llvm::Type*> fieldTypes{code->getType(), env->getType()};
+  auto type = llvm::StructType::get(module.getContext(), fieldTypes, false);
+
+  if(auto constantEnv = dyn_cast<llvm::Constant>(env)) {
+    vector<llvm::Constant*> fields{code, constantEnv};
+    return llvm::ConstantStruct::get(type, fields);
+  }
+
+  llvm::Value* closure = llvm::UndefValue::get(type);
+  closure = builder.CreateInsertValue(closure, code, 0);
+  return builder.CreateInsertValue(closure, env, 1, "closure");
+}
+
+// externs used as values are wrapped to take (and ignore) an environment
+llvm::Function* Compiler::GetExternThunk(llvm::Function* target, const Type& type)
+{
+  string name = (target->getName() + ".thunk").str();
+  if(auto thunk = module.getFunction(name))
+    return thunk;
+
+  auto thunkType = ToLLVMFunction(type, module.getContext(), true);
+  auto thunk = llvm::Function::Create(thunkType, llvm::Function::InternalLinkage, name, &module);
+  thunk->setCallingConv(llvm::CallingConv::Fast);
+
+  auto previousInsertPoint = builder.saveIP();
+  builder.SetInsertPoint(llvm::BasicBlock::Create(module.getContext(), "entry", thunk));
+
+  vector<llvm::Value*> arguments;
+  for(auto arg = thunk->arg_begin(); arg != thunk->arg_end(); ++arg)
+    arguments.push_back(&*arg);
+  arguments.pop_back();
+
+  auto value = CreateExternCall(target, type, arguments, true);
+  if(thunkType->getReturnType()->isVoidTy())
+    builder.CreateRetVoid();
+  else
+    builder.CreateRet(value);
+
+  builder.restoreIP(previousInsertPoint);
+  return thunk;
+}
+
+/*
+ * Strings are {data, length} pairs, but cross into C as NUL-terminated
+ * char pointers. Everything xra allocates and every literal has a NUL after
+ * its data, so only a slice that ends before its buffer does needs
+ * xra_string_cstr to copy it; strings coming back are measured with strlen.
+ */
+llvm::Value* Compiler::MakeString(llvm::Value* data, llvm::Value* length)
+{
+  auto type = llvm::cast<llvm::StructType>(ToLLVM(*StringType, module.getContext()));
+
+  auto constantData = dyn_cast<llvm::Constant>(data);
+  auto constantLength = dyn_cast<llvm::Constant>(length);
+  if(constantData && constantLength) {
+    vector<llvm::Constant*> fields{constantData, constantLength};
+    return llvm::ConstantStruct::get(type, fields);
+  }
+
+  llvm::Value* str = llvm::UndefValue::get(type);
+  str = builder.CreateInsertValue(str, data, 0);
+  return builder.CreateInsertValue(str, length, 1, "str");
+}
+
+llvm::Value* Compiler::CreateCString(llvm::Value* data, llvm::Value* length)
+{
+  vector<llvm::Type*> params{builder.getInt8PtrTy(), builder.getInt64Ty()};
+  auto type = llvm::FunctionType::get(builder.getInt8PtrTy(), params, false);
+  vector<llvm::Value*> args{data, length};
+  return builder.CreateCall(module.getOrInsertFunction("xra_string_cstr", type), args, "cstr");
+}
+
+llvm::Value* Compiler::CreateStringFromC(llvm::Value* cstr)
+{
+  vector<llvm::Type*> params{builder.getInt8PtrTy()};
+  auto type = llvm::FunctionType::get(builder.getInt64Ty(), params, false);
+  auto length = builder.CreateCall(module.getOrInsertFunction("strlen", type), cstr, "len");
+  return MakeString(cstr, length);
+}
+
+// how many values FlattenValue splits a value of this type into
+static size_t FlatSize(llvm::Type* type)
+{
+  auto structType = dyn_cast<llvm::StructType>(type);
+  if(!structType)
+    return type->isVoidTy() ? 0 : 1;
+
+  size_t size = 0;
+  for(unsigned int i = 0; i < structType->getNumElements(); i++)
+    size += FlatSize(structType->getElementType(i));
+  return size;
+}
+
+// calls an extern with arguments flattened for xra, converting strings
+llvm::Value* Compiler::CreateExternCall(llvm::Function* target, const Type& type,
+                                        const vector<llvm::Value*>& arguments, bool tail)
+{
+  auto& ctx = module.getContext();
+  auto& funcType = static_cast<const TFunction&>(type);
+
+  vector<llvm::Value*> cArguments;
+  auto arg = arguments.begin();
+  for(auto& f : static_cast<TList&>(*funcType.parameter).fields) {
+    if(isa<TString>(f.type.get())) {
+      auto data = *arg++;
+      auto length = *arg++;
+      cArguments.push_back(CreateCString(data, length));
+      continue;
+    }
+
+    for(size_t n = FlatSize(ToLLVM(*f.type, ctx)); n > 0; n--)
+      cArguments.push_back(*arg++);
+  }
+
+  auto call = builder.CreateCall(target, cArguments);
+  if(isa<TString>(funcType.result.get()))
+    return CreateStringFromC(call);
+
+  if(tail)
+    call->setTailCall();
+  return call;
+}
+
+/*
+ * Tuple parameters are passed as their flattened scalar fields (see
+ * ToLLVM(TFunction)), so tuples never need to be materialized in memory to
+ * cross a call.
+ */
+static void FlattenValue(llvm::IRBuilder<>& builder, llvm::Value* value, vector<llvm::Value*>& values)
+{
+  auto structType = dyn_cast<llvm::StructType>(value->getType());
+  if(!structType) {
+    values.push_back(value);
+    return;
+  }
+
+  for(unsigned int i = 0; i < structType->getNumElements(); i++)
+    FlattenValue(builder, builder.CreateExtractValue(value, i), values);
+}
+
+static llvm::Value* UnflattenArgument(llvm::IRBuilder<>& builder, llvm::Type* type,
+                                      llvm::Function::arg_iterator& arg, const string& name)
+{
+  auto structType = dyn_cast<llvm::StructType>(type);
+  if(!structType) {
+    arg->setName(name);
+    return arg++;
+  }
+
+  llvm::Value* value = llvm::UndefValue::get(structType);
+  for(unsigned int i = 0; i < structType->getNumElements(); i++) {
+    auto field = UnflattenArgument(builder, structType->getElementType(i), arg, name);
+    value = builder.CreateInsertValue(value, field, i, name);
+  }
+  return value;
+}
+
+void Compiler::FlattenArgument(const Expr& expr, vector<llvm::Value*>& arguments)
+{
+  // tuple literals are split up directly instead of being packed first
+  auto list = dyn_cast<EList>(&expr);
+  if(list && !list->exprs.empty()) {
+    for(auto& e : list->exprs)
+      FlattenArgument(*e, arguments);
+    return;
+  }
+
+  result = nullptr;
+  Visit(&expr);
+  if(result)
+    FlattenValue(builder, Load(result), arguments);
+  result = nullptr;
+}
+
 void Compiler::VisitEVariable(const EVariable& expr)
 {
-  if(isa<VLocal>(expr.value.get())) {
+  if(auto local = dyn_cast<VLocal>(expr.value.get())) {
+    // folded constants have no slot
+    auto constant = constants.find(local);
+    if(constant != constants.end()) {
+      result = builder.CreateCall(constant->second);
+      return;
+    }
+
     auto& alloc = values[expr.name];
     if(!alloc) {
       auto type = ToLLVM(*expr.value->type, module.getContext());
-      alloc = builder.CreateAlloca(type, nullptr, expr.name);
+      alloc = CreateEntrySlot(type, expr.name, function && function->boxed.count(expr.name));
     }
     result = alloc;
   }
   else if(isa<VExtern>(expr.value.get())) {
     result = module.getGlobalVariable(expr.name);
-    if(!result)
-      result = module.getFunction(expr.name);
+    if(result && isa<TString>(expr.value->type.get()))
+      result = CreateStringFromC(builder.CreateLoad(result));
+    else if(result)
+      slots.insert(result);
+    else
+      result = MakeClosure(GetExternThunk(module.getFunction(expr.name), *expr.value->type),
+                           llvm::Constant::getNullValue(builder.getInt8PtrTy()));
   }
 
   assert(result);
@@ -40,64 +315,334 @@ void Compiler::VisitEFloat(const EFloat& expr)
 
 void Compiler::VisitEString(const EString& expr)
 {
-  result = builder.CreateGlobalStringPtr(expr.literal, "EString");
+  auto data = builder.CreateGlobalStringPtr(expr.literal, "EString");
+  result = MakeString(data, builder.getInt64(expr.literal.size()));
 }
 
+namespace {
+
+// whether a function body calls the function through the local it is bound
+// to; calls from nested functions are theirs and do not count
+class SelfCallCheck : public Visitor<SelfCallCheck, const Expr>
+{
+public:
+  SelfCallCheck(const VLocal* self_) :
+    self(self_),
+    found(false)
+  {}
+
+  bool Check(const Expr& body)
+  {
+    Visit(&body);
+    return found;
+  }
+
+  void VisitEFunction(const EFunction&) {}
+
+  void VisitECall(const ECall& expr)
+  {
+    auto callee = dyn_cast<EVariable>(expr.function.get());
+    if(callee && callee->value.get() == self)
+      found = true;
+    base::VisitECall(expr);
+  }
+
+private:
+  const VLocal* self;
+  bool found;
+};
+
+} // namespace
+
 void Compiler::VisitEFunction(const EFunction& expr)
 {
+  auto& ctx = module.getContext();
+  bool topLevel = !builder.GetInsertBlock();
+
+  // a function bound to a name can call itself through that name
+  string selfName;
+  selfName.swap(bindingName);
+  bool recursive = !selfName.empty();
+
+  // build the environment in the enclosing function
+  const VLocal* self = nullptr;
+  vector<const EFunction::Capture*> captures;
+  for(auto& capture : expr.captures) {
+    if(capture.name != selfName)
+      captures.push_back(&capture);
+    else
+      self = capture.local;
+  }
+
+  // only a function that calls itself needs its parameters in slots for
+  // tail calls to overwrite; mem2reg undoes this where no call is a tail call
+  bool tailRecursive = self && SelfCallCheck(self).Check(*expr.body);
+
+  llvm::Value* env = llvm::Constant::getNullValue(builder.getInt8PtrTy());
+  llvm::StructType* envType = nullptr;
+  if(!captures.empty()) {
+    vector<llvm::Value*> pointers;
+    vector<llvm::Type*> pointerTypes;
+    for(auto capture : captures) {
+      pointers.push_back(GetSlot(*capture));
+      pointerTypes.push_back(pointers.back()->getType());
+    }
+    envType = llvm::StructType::get(ctx, pointerTypes, false);
+
+    // closures that cannot outlive this frame keep their environment on its stack
+    llvm::Value* envPtr;
+    if(expr.escapes) {
+      envPtr = CreateHeapAlloc(envType, "env");
+    }
+    else {
+      envPtr = CreateEntryAlloca(envType, "env");
+      hasStackEnv = true;
+    }
+
+    for(unsigned int i = 0; i < pointers.size(); i++)
+      builder.CreateStore(pointers[i], builder.CreateStructGEP(envPtr, i));
+    env = builder.CreateBitCast(envPtr, builder.getInt8PtrTy());
+  }
+
   auto previousBlock = builder.GetInsertBlock();
   map<string, llvm::Value*> previousValues;
   previousValues.swap(values);
+  auto previousFunction = function;
+  auto previousFunctionName = functionName;
+  auto previousSelfClosure = selfClosure;
+  auto previousSelfLocal = selfLocal;
+  auto previousHasStackEnv = hasStackEnv;
+  auto previousTailRecurseBlock = tailRecurseBlock;
+  auto previousEndLoopBlock = endLoopBlock;
+  auto previousRegionDepth = regionDepth;
+  auto previousLoopRegionDepth = loopRegionDepth;
+  vector<llvm::Value*> previousParamSlots;
+  previousParamSlots.swap(paramSlots);
+
+  function = &expr;
+  functionName = topLevel ? "xra" : functionName + "." + (recursive ? selfName : "fn");
+  if(topLevel)
+    topLevelFunction = &expr;
+  hasStackEnv = false;
+  regionDepth = 0;
+  loopRegionDepth = 0;
+
+  // create function; the top level is called from C and takes no environment,
+  // everything else only from xra code and can use the fast calling convention
+  auto funcType = ToLLVMFunction(*expr.value->type, ctx, !topLevel);
+  auto func = llvm::Function::Create(funcType, llvm::Function::InternalLinkage,
+                                     topLevel ? "xra.main" : functionName, &module);
+  if(!topLevel)
+    func->setCallingConv(llvm::CallingConv::Fast);
+  knownFunctions[&expr] = {func, !captures.empty()};
+
+  auto block = llvm::BasicBlock::Create(ctx, "entry", func);
+  builder.SetInsertPoint(block);
+
+  llvm::Value* envArg = nullptr;
+  if(!topLevel) {
+    envArg = &func->getArgumentList().back();
+    envArg->setName("env");
+  }
+
+  selfClosure = nullptr;
+  selfLocal = self;
+  if(recursive) {
+    selfClosure = MakeClosure(func, envArg ? envArg : env);
+    values[selfName] = selfClosure;
+  }
+
+  // captured variables are reached through the environment
+  if(envType) {
+    auto typedEnv = builder.CreateBitCast(envArg, envType->getPointerTo());
+    for(unsigned int i = 0; i < captures.size(); i++) {
+      auto pointer = builder.CreateLoad(builder.CreateStructGEP(typedEnv, i), captures[i]->name);
+      values[captures[i]->name] = pointer;
+      slots.insert(pointer);
+    }
+  }
+
+  // put arguments into values map, reassembling flattened tuples
+  // self-calling functions keep them in slots so tail calls can overwrite
+  // them, and captured ones need a slot for closures to point to
+  auto arg = func->arg_begin();
+  for(auto& field : static_cast<TList&>(*expr.param).fields) {
+    auto type = ToLLVM(*field.type, ctx);
+    if(type->isVoidTy()) {
+      if(tailRecursive)
+        paramSlots.push_back(nullptr);
+      continue;
+    }
 
-  // create function
-  auto funcType = static_cast<llvm::FunctionType*>(ToLLVM(*expr.value->type, module.getContext())->getPointerElementType());
-  auto func = llvm::Function::Create(funcType, llvm::Function::InternalLinkage, "EFunction", &module);
-  auto block = llvm::BasicBlock::Create(module.getContext(), "entry", func);
+    auto value = UnflattenArgument(builder, type, arg, field.name);
+    if(tailRecursive || expr.captured.count(field.name)) {
+      auto slot = CreateEntrySlot(type, field.name, expr.boxed.count(field.name) != 0);
+      builder.CreateStore(value, slot);
+      value = slot;
+    }
+    if(tailRecursive)
+      paramSlots.push_back(value);
+    values[field.name] = value;
+  }
 
-  // put arguments into values map
-  auto field = static_cast<TList&>(*expr.param).fields.begin();
-  for(auto& arg : func->getArgumentList()) {
-    values[field->name] = &arg;
-    ++field;
+  if(tailRecursive) {
+    tailRecurseBlock = llvm::BasicBlock::Create(ctx, "tailrecurse", func);
+    builder.CreateBr(tailRecurseBlock);
+    builder.SetInsertPoint(tailRecurseBlock);
   }
+  else {
+    tailRecurseBlock = nullptr;
+  }
+
+  // a break in the body of a for over a generator tells it to stop
+  endLoopBlock = expr.loopBody ? llvm::BasicBlock::Create(ctx, "break") : nullptr;
 
   // fill in function
-  builder.SetInsertPoint(block);
-  Visit(expr.body.get());
+  Visit(expr.body.get(), true);
   builder.CreateRet(Load(result));
 
+  if(endLoopBlock && !endLoopBlock->use_empty()) {
+    func->getBasicBlockList().push_back(endLoopBlock);
+    builder.SetInsertPoint(endLoopBlock);
+    builder.CreateRet(builder.getFalse());
+  }
+  else {
+    delete endLoopBlock;
+  }
+
+  // callees may be handed pointers into this frame's stack environments
+  if(hasStackEnv) {
+    for(auto& bb : *func) {
+      for(auto& inst : bb) {
+        if(auto call = dyn_cast<llvm::CallInst>(&inst))
+          call->setTailCall(false);
+      }
+    }
+  }
+
   verifyFunction(*func);
 
   // restore function state
-  builder.SetInsertPoint(previousBlock);
+  if(previousBlock)
+    builder.SetInsertPoint(previousBlock);
+  else
+    builder.ClearInsertionPoint();
   values.swap(previousValues);
+  function = previousFunction;
+  functionName = previousFunctionName;
+  selfClosure = previousSelfClosure;
+  selfLocal = previousSelfLocal;
+  hasStackEnv = previousHasStackEnv;
+  tailRecurseBlock = previousTailRecurseBlock;
+  endLoopBlock = previousEndLoopBlock;
+  regionDepth = previousRegionDepth;
+  loopRegionDepth = previousLoopRegionDepth;
+  paramSlots.swap(previousParamSlots);
 
-  result = func;
+  result = topLevel ? static_cast<llvm::Value*>(func) : MakeClosure(func, env);
 }
 
 void Compiler::VisitECall(const ECall& expr)
 {
+  bool isTail = tailPosition;
+
   auto builtin = dyn_cast<VBuiltin>(expr.function->value.get());
   if(builtin)
   {
     assert(isa<EList>(expr.argument.get()));
     auto& args = static_cast<EList&>(*expr.argument).exprs;
     builtin->Compile(*this, args);
+    return;
   }
-  else
-  {
+
+  auto& args = static_cast<EList&>(*expr.argument).exprs;
+  auto func = builder.GetInsertBlock()->getParent();
+
+  llvm::Value* callee;
+  llvm::Value* env = nullptr;
+
+  auto var = dyn_cast<EVariable>(expr.function.get());
+  if(var && isa<VExtern>(var->value.get()) && isa<TFunction>(var->value->type.get())) {
+    // externs are called directly and take no environment
+    vector<llvm::Value*> arguments;
+    for(auto& arg : args)
+      FlattenArgument(*arg, arguments);
+    result = CreateExternCall(module.getFunction(var->name), *var->value->type, arguments, isTail);
+    return;
+  }
+
+  // a local only ever assigned one function is called directly
+  auto local = var ? dyn_cast<VLocal>(var->value.get()) : nullptr;
+  const KnownFunction* known = nullptr;
+  if(local && local->function) {
+    auto it = knownFunctions.find(local->function);
+    if(it != knownFunctions.end())
+      known = &it->second;
+  }
+
+  // calls through the binding of the function being compiled go to itself,
+  // whether its closure is an SSA value or was moved to a slot for capture
+  bool selfCall = local && local == selfLocal;
+
+  llvm::Value* closure = nullptr;
+  if(!selfCall && (!known || known->capturing)) {
     Visit(expr.function.get());
-    auto function = Load(result);
+    closure = Load(result);
+  }
+
+  // a self-recursive call in tail position becomes a jump back to the top
+  if(isTail && selfCall && tailRecurseBlock)
+  {
+    assert(args.size() == paramSlots.size());
 
+    // evaluate every argument before overwriting any parameter
     vector<llvm::Value*> arguments;
-    for(auto& arg : static_cast<EList&>(*expr.argument).exprs) {
+    for(auto& arg : args) {
       Visit(arg.get());
       arguments.push_back(Load(result));
       result = nullptr;
     }
 
-    result = builder.CreateCall(function, arguments);
+    for(size_t i = 0; i < arguments.size(); i++) {
+      if(paramSlots[i])
+        builder.CreateStore(arguments[i], paramSlots[i]);
+    }
+    builder.CreateBr(tailRecurseBlock);
+
+    auto contBlock = llvm::BasicBlock::Create(module.getContext(), "tailcont", func);
+    builder.SetInsertPoint(contBlock);
+
+    auto returnType = func->getReturnType();
+    result = returnType->isVoidTy() ? nullptr : llvm::UndefValue::get(returnType);
+    return;
+  }
+
+  if(selfCall) {
+    callee = func;
+    env = &func->getArgumentList().back();
+  }
+  else if(known) {
+    callee = known->code;
+    env = known->capturing ? builder.CreateExtractValue(closure, 1)
+      : llvm::Constant::getNullValue(builder.getInt8PtrTy());
+  }
+  else {
+    callee = builder.CreateExtractValue(closure, 0);
+    env = builder.CreateExtractValue(closure, 1);
   }
+
+  vector<llvm::Value*> arguments;
+  for(auto& arg : args)
+    FlattenArgument(*arg, arguments);
+  if(env)
+    arguments.push_back(env);
+
+  auto call = builder.CreateCall(callee, arguments);
+  if(env)
+    call->setCallingConv(llvm::CallingConv::Fast);
+  if(isTail)
+    call->setTailCall();
+  result = call;
 }
 
 void Compiler::VisitEList(const EList& expr)
@@ -105,29 +650,31 @@ void Compiler::VisitEList(const EList& expr)
   if(expr.exprs.empty())
     return;
 
+  // tuples are first-class SSA aggregates; SROA splits them into scalars
   auto type = ToLLVM(*expr.value->type, module.getContext());
-  auto alloc = builder.CreateAlloca(type, nullptr, "tmplist");
+  llvm::Value* tuple = llvm::UndefValue::get(type);
 
   unsigned int i = 0;
   for(auto& e : expr.exprs) {
     Visit(e.get());
-    builder.CreateStore(Load(result), builder.CreateStructGEP(alloc, i++, "tmplistslot"));
+    tuple = builder.CreateInsertValue(tuple, Load(result), i++, "tmplist");
     result = nullptr;
   }
 
-  result = alloc;
+  result = tuple;
 }
 
 void Compiler::VisitEExtern(const EExtern& expr)
 {
   if(isa<TFunction>(expr.externType.get()))
   {
-    auto funcType = dyn_cast<llvm::FunctionType>(ToLLVM(*expr.externType, module.getContext())->getPointerElementType());
+    auto funcType = ToLLVMExtern(*expr.externType, module.getContext());
     llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, expr.name, &module);
   }
   else
   {
-    auto varType = ToLLVM(*expr.externType, module.getContext());
+    auto varType = isa<TString>(expr.externType.get()) ? builder.getInt8PtrTy()
+      : ToLLVM(*expr.externType, module.getContext());
     new llvm::GlobalVariable(module, varType, false, llvm::GlobalVariable::ExternalLinkage, nullptr, expr.name);
   }
 }
@@ -11,23 +11,104 @@ public:
   llvm::Module& module;
   llvm::IRBuilder<> builder;
   map<string, llvm::Value*> values;
+  set<llvm::Value*> slots; // values that point to a variable's storage
   llvm::BasicBlock* endLoopBlock;
+
+  // regions entered in the current function and not yet left, and how many
+  // of them the innermost loop was entered in; a return or break leaves
+  // the ones in between
+  unsigned int regionDepth;
+  unsigned int loopRegionDepth;
   llvm::Value* result;
 
+  // true while visiting an expression whose value the function returns as is
+  bool tailPosition;
+
+  // name the function being assigned is bound to (set by BAssign)
+  string bindingName;
+
+  // the function being compiled, its qualified name, the closure it can
+  // call itself through and the local that closure is bound to
+  const EFunction* function;
+  string functionName;
+  llvm::Value* selfClosure;
+  const VLocal* selfLocal;
+
+  // functions that calls through single-assignment bindings go to directly
+  struct KnownFunction
+  {
+    llvm::Function* code;
+    bool capturing;
+  };
+  map<const EFunction*, KnownFunction> knownFunctions;
+
+  // set once the current function puts a closure environment on its stack
+  bool hasStackEnv;
+
+  // float operations get fast-math flags (-ffast-math, or inside fastmath)
+  bool fastMath;
+
+  // pure scalars assigned once at the top level are read through helpers
+  // that FoldConstants evaluates at compile time
+  bool foldConstants;
+  const EFunction* topLevelFunction;
+  map<const VLocal*, llvm::Function*> constants;
+  vector<llvm::Function*> constantHelpers;
+
+  // self-recursive tail calls store to paramSlots and branch to tailRecurseBlock
+  llvm::BasicBlock* tailRecurseBlock;
+  vector<llvm::Value*> paramSlots;
+
   Compiler(llvm::Module& module_) :
     module(module_),
     builder(module_.getContext()),
     endLoopBlock(nullptr),
-    result(nullptr)
+    regionDepth(0),
+    loopRegionDepth(0),
+    result(nullptr),
+    tailPosition(false),
+    function(nullptr),
+    selfClosure(nullptr),
+    selfLocal(nullptr),
+    hasStackEnv(false),
+    fastMath(false),
+    foldConstants(false),
+    topLevelFunction(nullptr),
+    tailRecurseBlock(nullptr)
   {}
 
+  void Visit(const Base* node, bool tail = false)
+  {
+    tailPosition = tail;
+    base::Visit(node);
+    tailPosition = false;
+  }
+
   llvm::Value* Load(llvm::Value* val)
   {
-    if(val && isa<llvm::AllocaInst>(val))
+    if(val && slots.count(val))
       return builder.CreateLoad(val);
     return val;
   }
 
+  llvm::AllocaInst* CreateEntryAlloca(llvm::Type*, const llvm::Twine& name = "");
+  llvm::Value* CreateAlloc(llvm::Value* size, const llvm::Twine& name = "");
+  llvm::Value* CreateHeapAlloc(llvm::Type*, const llvm::Twine& name = "");
+  void CreateRegionCall(const char* name);
+  void LeaveRegions(unsigned int depth);
+  llvm::Value* CreateEntrySlot(llvm::Type*, const string& name, bool boxed);
+  llvm::Value* GetSlot(const EFunction::Capture&);
+  llvm::Value* MakeClosure(llvm::Function* code, llvm::Value* env);
+  llvm::Function* GetExternThunk(llvm::Function* target, const Type& type);
+  llvm::Value* MakeString(llvm::Value* data, llvm::Value* length);
+  llvm::Value* CreateCString(llvm::Value* data, llvm::Value* length);
+  llvm::Value* CreateStringFromC(llvm::Value* cstr);
+  llvm::Value* CreateExternCall(llvm::Function* target, const Type& type,
+                                const vector<llvm::Value*>& arguments, bool tail);
+  void FlattenArgument(const Expr&, vector<llvm::Value*>&);
+  bool IsPure(const Expr&) const;
+  llvm::Value* CreateConstant(const VLocal&, const Expr&);
+
   void VisitEVariable(const EVariable&);
   void VisitEBoolean(const EBoolean&);
   void VisitEInteger(const EInteger&);
@@ -39,6 +120,9 @@ public:
   void VisitEExtern(const EExtern&);
 };
 
+// closure.cpp
+void AnalyzeClosures(Expr&);
+
 } // namespace xra
 
 #endif // XRA_COMPILER_HPP
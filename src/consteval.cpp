@@ -0,0 +1,284 @@
+#include "common.hpp"
+#include "compiler.hpp"
+#include "backend.hpp"
+#include <llvm/Analysis/Verifier.h>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace xra {
+
+/*
+ * Compile-time evaluation. A top-level local assigned exactly once, with a
+ * side-effect-free scalar expression, is computed by a helper function
+ * xra.const.N that reads of the local call instead of loading its slot.
+ * Once the module is complete, FoldConstants JITs the helpers in a child
+ * process and replaces every call with the value it returned. The child
+ * keeps a helper that traps or runs too long from taking the compiler with
+ * it; such a helper is left to run once at the assignment, which stores its
+ * result in xra.const.N.value for the reads to load.
+ */
+
+// seconds the child may spend evaluating every helper
+static const unsigned int ConstantEvalSeconds = 2;
+
+namespace {
+
+// whether an expression only computes a value: it may call builtins that
+// have no effects of their own and functions that are pure in turn, and
+// read folded constants, its own parameters and locals, but nothing else
+class PurityCheck : public Visitor<PurityCheck, const Expr>
+{
+public:
+  PurityCheck(const Compiler& compiler_) :
+    compiler(compiler_),
+    scope(nullptr),
+    pure(true)
+  {}
+
+  bool Check(const Expr& expr)
+  {
+    Visit(&expr);
+    return pure;
+  }
+
+  void VisitEVariable(const EVariable& expr)
+  {
+    auto local = dyn_cast<VLocal>(expr.value.get());
+    if(!local || (!compiler.constants.count(local) && (!scope || local->owner != scope)))
+      pure = false;
+  }
+
+  void VisitEFunction(const EFunction&) { pure = false; }
+  void VisitEExtern(const EExtern&) { pure = false; }
+  void VisitETypeAlias(const ETypeAlias&) { pure = false; }
+
+  void VisitECall(const ECall& expr)
+  {
+    auto callee = dyn_cast<EVariable>(expr.function.get());
+    if(!callee) {
+      pure = false;
+      return;
+    }
+
+    // a return at the top level would leave the helper instead
+    auto builtin = dyn_cast<VBuiltin>(callee->value.get());
+    if(builtin)
+      pure = builtin->IsPure() && (scope || callee->name != "#return");
+    else
+      pure = CheckFunction(dyn_cast<VLocal>(callee->value.get()));
+
+    if(pure)
+      Visit(expr.argument.get());
+  }
+
+private:
+  // only direct calls to compiled functions without an environment qualify
+  bool CheckFunction(const VLocal* local)
+  {
+    if(!local || !local->function)
+      return false;
+
+    auto function = local->function;
+    auto known = compiler.knownFunctions.find(function);
+    if(known == compiler.knownFunctions.end() || known->second.capturing)
+      return false;
+    if(!checked.insert(function).second)
+      return true;
+
+    auto previousScope = scope;
+    scope = function;
+    Visit(function->body.get());
+    scope = previousScope;
+    return pure;
+  }
+
+  const Compiler& compiler;
+  const EFunction* scope; // the function whose body is checked, null at the top level
+  set<const EFunction*> checked;
+  bool pure;
+};
+
+} // namespace
+
+bool Compiler::IsPure(const Expr& expr) const
+{
+  PurityCheck check(*this);
+  return check.Check(expr);
+}
+
+llvm::Value* Compiler::CreateConstant(const VLocal& local, const Expr& expr)
+{
+  auto& ctx = module.getContext();
+  auto type = ToLLVM(*expr.value->type, ctx);
+  auto helper = llvm::Function::Create(llvm::FunctionType::get(type, false), llvm::Function::InternalLinkage,
+                                       "xra.const." + llvm::Twine(constantHelpers.size()), &module);
+  // the expression may allocate, so the helper is not readnone
+  helper->setDoesNotThrow();
+
+  auto previousInsertPoint = builder.saveIP();
+  auto previousSelfClosure = selfClosure;
+  auto previousSelfLocal = selfLocal;
+  auto previousTailRecurseBlock = tailRecurseBlock;
+  selfClosure = nullptr;
+  selfLocal = nullptr;
+  tailRecurseBlock = nullptr;
+
+  builder.SetInsertPoint(llvm::BasicBlock::Create(ctx, "entry", helper));
+  Visit(&expr);
+  builder.CreateRet(Load(result));
+  result = nullptr;
+  verifyFunction(*helper);
+
+  builder.restoreIP(previousInsertPoint);
+  selfClosure = previousSelfClosure;
+  selfLocal = previousSelfLocal;
+  tailRecurseBlock = previousTailRecurseBlock;
+
+  constants[&local] = helper;
+  constantHelpers.push_back(helper);
+
+  // where the result goes in case the helper cannot be folded
+  auto value = new llvm::GlobalVariable(module, type, false, llvm::GlobalValue::InternalLinkage,
+                                        llvm::Constant::getNullValue(type), helper->getName() + ".value");
+  auto init = builder.CreateCall(helper);
+  builder.CreateStore(init, value);
+  return init;
+}
+
+// runs in the child; writes each result's bits to fd as it is computed
+static void EvaluateHelpers(llvm::Module& module, const vector<llvm::Function*>& helpers,
+                            const BackendOptions& options, int fd)
+{
+  auto jitOptions = options;
+  jitOptions.optLevel = 0;
+  jitOptions.lazyJIT = true;
+
+  string err;
+  auto engine = CreateJIT(&module, jitOptions, err);
+  if(!engine)
+    return;
+
+  for(auto helper : helpers) {
+    auto code = (uintptr_t)engine->getPointerToFunction(helper);
+    auto type = helper->getReturnType();
+
+    uint64_t bits = 0;
+    if(type->isFloatTy()) {
+      float value = ((float (*)())code)();
+      memcpy(&bits, &value, sizeof(value));
+    }
+    else if(type->isDoubleTy()) {
+      double value = ((double (*)())code)();
+      memcpy(&bits, &value, sizeof(value));
+    }
+    else if(type->isIntegerTy(1))
+      bits = ((bool (*)())code)();
+    else if(type->isIntegerTy(8))
+      bits = ((uint8_t (*)())code)();
+    else if(type->isIntegerTy(16))
+      bits = ((uint16_t (*)())code)();
+    else if(type->isIntegerTy(32))
+      bits = ((uint32_t (*)())code)();
+    else if(type->isIntegerTy(64))
+      bits = ((uint64_t (*)())code)();
+    else
+      return;
+
+    if(write(fd, &bits, sizeof(bits)) != sizeof(bits))
+      return;
+  }
+}
+
+static llvm::Constant* MakeConstant(llvm::Type* type, uint64_t bits)
+{
+  if(type->isFloatTy()) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return llvm::ConstantFP::get(type, value);
+  }
+  if(type->isDoubleTy()) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return llvm::ConstantFP::get(type, value);
+  }
+  return llvm::ConstantInt::get(type, bits);
+}
+
+// the results of the helpers the child evaluated before it finished, trapped or timed out
+static vector<uint64_t> EvaluateInChild(llvm::Module& module, const vector<llvm::Function*>& helpers,
+                                        const BackendOptions& options)
+{
+  vector<uint64_t> results;
+
+  int fds[2];
+  if(pipe(fds) != 0)
+    return results;
+
+  pid_t pid = fork();
+  if(pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return results;
+  }
+
+  if(pid == 0) {
+    close(fds[0]);
+    alarm(ConstantEvalSeconds);
+    EvaluateHelpers(module, helpers, options, fds[1]);
+    _exit(EXIT_SUCCESS);
+  }
+
+  close(fds[1]);
+  uint64_t bits;
+  while(read(fds[0], &bits, sizeof(bits)) == sizeof(bits))
+    results.push_back(bits);
+  close(fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  return results;
+}
+
+void FoldConstants(llvm::Module& module, const vector<llvm::Function*>& helpers, const BackendOptions& options)
+{
+  if(helpers.empty())
+    return;
+
+  // results arrive in order; helpers after one that trapped or timed out have none
+  auto results = EvaluateInChild(module, helpers, options);
+
+  for(size_t i = 0; i < helpers.size(); i++) {
+    auto helper = helpers[i];
+    auto value = module.getNamedGlobal((helper->getName() + ".value").str());
+    assert(value && value->hasOneUse());
+    auto store = llvm::cast<llvm::StoreInst>(*value->use_begin());
+    auto init = store->getValueOperand();
+
+    vector<llvm::CallInst*> calls;
+    for(auto it = helper->use_begin(); it != helper->use_end(); ++it)
+      calls.push_back(llvm::cast<llvm::CallInst>(*it));
+
+    // an unfolded helper runs at the assignment only; reads load what it stored
+    if(i >= results.size()) {
+      for(auto call : calls) {
+        if(call == init)
+          continue;
+        call->replaceAllUsesWith(new llvm::LoadInst(value, "", call));
+        call->eraseFromParent();
+      }
+      continue;
+    }
+
+    auto constant = MakeConstant(helper->getReturnType(), results[i]);
+    store->eraseFromParent();
+    value->eraseFromParent();
+    for(auto call : calls) {
+      call->replaceAllUsesWith(constant);
+      call->eraseFromParent();
+    }
+    helper->eraseFromParent();
+  }
+}
+
+} // namespace xra
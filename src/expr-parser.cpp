@@ -22,9 +22,16 @@ static const map<string, pair<int, bool> > binaryOperators {
   {"*", {16, false}},
   {"/", {16, false}},
   {"%", {16, false}},
+  {"*%", {16, false}},
+  {"*!", {16, false}},
   {"#custom", {15, false}}, // default settings for custom operators (any not listed)
   {"+", {14, false}},
   {"-", {14, false}},
+  {"+%", {14, false}},
+  {"-%", {14, false}},
+  {"+!", {14, false}},
+  {"-!", {14, false}},
+  {"++", {14, false}},
   {"<<", {13, false}},
   {">>", {13, false}},
   {"<", {12, false}},
@@ -38,6 +45,7 @@ static const map<string, pair<int, bool> > binaryOperators {
   {"|", {8, false}},
   {"&&", {7, false}},
   {"||", {6, false}},
+  {"..", {5, false}},
   {",", {4, false}},
   {"=", {3, true}},
   {"#if", {2, false}},
@@ -61,6 +69,9 @@ ExprPtr ExprParser::FlatBlock()
   while(true) {
     list->exprs.push_back(Expr());
 
+    if(Diagnostics::Current().Aborted())
+      return {};
+
     if(!TOKEN(Nodent))
       break;
     lexer.Consume();
@@ -152,7 +163,34 @@ ExprPtr ExprParser::Using() // prefix: using
 
 ExprPtr ExprParser::Fn() // prefix: fn
 {
-  return new EFunction(ParseTypeList(lexer), Clause());
+  // only generators may go without a parameter list
+  bool hasParams = !TOKEN(Colon) && !TOKEN(Indent);
+  TypePtr param = hasParams ? ParseTypeList(lexer) : TypePtr();
+
+  bool outerYielded = yielded;
+  yielded = false;
+  ExprPtr body = Clause();
+  bool isGenerator = yielded;
+  yielded = outerYielded;
+
+  if(!isGenerator) {
+    if(!hasParams)
+      ERROR("expected parameter list")
+    return new EFunction(param, body);
+  }
+
+  // a generator takes the body of the for that runs it as a hidden last
+  // parameter, calls it for each yield and returns nothing
+  if(!param)
+    param = new TList;
+  static_cast<TList&>(*param).fields.push_back({"#consumer", MakeTypeVar()});
+  auto list = make_unique<EList>();
+  list->exprs.push_back(body);
+  list->exprs.push_back(new EList);
+
+  auto func = new EFunction(param, new ECall(new EVariable(";"), list.release()));
+  func->generator = true;
+  return func;
 }
 
 ExprPtr ExprParser::If() // prefix: if
@@ -198,11 +236,150 @@ ExprPtr ExprParser::While() // prefix: while
   return new ECall(new EVariable("#while"), list.release());
 }
 
+ExprPtr ExprParser::For() // prefix: for
+{
+  auto list = make_unique<EList>();
+
+  if(!TOKEN(Identifier))
+    EXPECTED(Identifier)
+  list->exprs.push_back(new EVariable(lexer().strValue));
+  lexer.Consume();
+
+  if(!TOKEN(In))
+    EXPECTED(In)
+  lexer.Consume();
+
+  ExprPtr range = Expr();
+  auto rangeCall = dyn_cast_or_null<ECall>(range.get());
+  auto rangeOp = rangeCall ? dyn_cast<EVariable>(rangeCall->function.get()) : nullptr;
+  if(!rangeCall)
+    EXPECTED(RangeOrGenerator)
+
+  // a generator call gets the body as its consumer: a function of the loop
+  // variable that returns false on break
+  if(!rangeOp || rangeOp->name != "..") {
+    auto param = make_unique<TList>();
+    param->fields.push_back({static_cast<EVariable&>(*list->exprs.front()).name, MakeTypeVar()});
+
+    auto body = make_unique<EList>();
+    body->exprs.push_back(Clause());
+    body->exprs.push_back(new EBoolean(true));
+
+    auto consumer = new EFunction(param.release(), new ECall(new EVariable(";"), body.release()));
+    consumer->loopBody = true;
+    static_cast<EList&>(*rangeCall->argument).exprs.push_back(consumer);
+    return range;
+  }
+
+  // the bounds of a..b become arguments of the loop itself
+  for(auto& bound : static_cast<EList&>(*rangeCall->argument).exprs)
+    list->exprs.push_back(move(bound));
+
+  if(TOKEN(By)) {
+    lexer.Consume();
+    list->exprs.push_back(Expr());
+  }
+
+  list->exprs.push_back(Clause());
+
+  return new ECall(new EVariable("#for"), list.release());
+}
+
+ExprPtr ExprParser::Parallel() // prefix: parallel
+{
+  // options come first; an empty list stands for one left out
+  ExprPtr reduce = new EList;
+  ExprPtr chunk = new EList;
+  while(TOKEN(Identifier)) {
+    if(lexer().strValue == "reduce") {
+      lexer.Consume();
+      if(!TOKEN(Operator))
+        EXPECTED(Operator)
+      reduce = new EVariable(lexer().strValue);
+      lexer.Consume();
+    }
+    else if(lexer().strValue == "chunk") {
+      lexer.Consume();
+      chunk = Expr_P(true);
+      if(!chunk)
+        return {};
+    }
+    else {
+      break;
+    }
+  }
+
+  if(!TOKEN(For))
+    EXPECTED(For)
+  lexer.Consume();
+
+  ExprPtr loop = For();
+  if(!loop)
+    return {};
+
+  // the body becomes a function of the loop variable, run for each chunk
+  // of the range on whichever thread takes it; #parallel gives the
+  // parameter the type of the bounds
+  auto& loopArgs = static_cast<EList&>(*static_cast<ECall&>(*loop).argument).exprs;
+  auto param = make_unique<TList>();
+  param->fields.push_back({static_cast<EVariable&>(*loopArgs.front()).name, MakeTypeVar()});
+
+  auto list = make_unique<EList>();
+  list->exprs.push_back(move(reduce));
+  list->exprs.push_back(move(chunk));
+  for(size_t i = 1; i < loopArgs.size() - 1; i++)
+    list->exprs.push_back(move(loopArgs[i]));
+  list->exprs.push_back(new EFunction(param.release(), move(loopArgs.back())));
+
+  return new ECall(new EVariable("#parallel"), list.release());
+}
+
 ExprPtr ExprParser::Break() // prefix: break
 {
   return new ECall(new EVariable("#break"), new EList);
 }
 
+ExprPtr ExprParser::Yield() // prefix: yield
+{
+  yielded = true;
+
+  auto list = make_unique<EList>();
+  list->exprs.push_back(Expr());
+  return new ECall(new EVariable("#yield"), list.release());
+}
+
+ExprPtr ExprParser::Region() // prefix: region
+{
+  auto list = make_unique<EList>();
+  list->exprs.push_back(Clause());
+  return new ECall(new EVariable("#region"), list.release());
+}
+
+// "a{x}b" is #interpolate ["a", x, "b"]: the text around every slot
+ExprPtr ExprParser::Interpolation()
+{
+  auto list = make_unique<EList>();
+  auto slots = lexer().intValue;
+  list->exprs.push_back(new EString(lexer().strValue));
+  lexer.Consume();
+
+  for(unsigned long i = 0; i < slots; i++) {
+    if(!TOKEN(OpenParen))
+      EXPECTED(OpenParen)
+    auto slot = Expr_P(true);
+    if(!slot)
+      return {};
+    list->exprs.push_back(slot);
+
+    if(!TOKEN(String))
+      EXPECTED(String)
+    list->exprs.push_back(new EString(lexer().strValue));
+    lexer.Consume();
+  }
+
+  return new ECall(new EVariable("#interpolate"), list.release());
+}
+
 ExprPtr ExprParser::Return() // prefix: return
 {
   auto list = make_unique<EList>();
@@ -277,7 +454,10 @@ ExprPtr ExprParser::Expr(bool required, int precedence)
     bool rightAssoc = binaryOp->second.second;
     if(prec < precedence)
       break;
-    
+
+    // calls are located at their callee, other operations at the operator
+    auto loc = (op == "#call") ? expr->loc : lexer().loc;
+
     if(op != "#call")
       lexer.Consume();
 
@@ -302,6 +482,7 @@ ExprPtr ExprParser::Expr(bool required, int precedence)
         exprRight = list.release();
       }
       expr = new ECall(expr, exprRight);
+      expr->loc = loc;
     }
     else if(op == "," && lastOp == ",") {
       auto list = static_cast<EList*>(expr.get());
@@ -315,10 +496,15 @@ ExprPtr ExprParser::Expr(bool required, int precedence)
       list->exprs.push_back(move(expr));
       list->exprs.push_back(move(exprRight));
 
-      if(op == ",")
+      if(op == ",") {
         expr = list.release();
-      else
-        expr = new ECall(new EVariable(op), list.release());
+      }
+      else {
+        ExprPtr function = new EVariable(op);
+        function->loc = loc;
+        expr = new ECall(function, list.release());
+      }
+      expr->loc = loc;
     }
 
     lastOp = move(op);
@@ -330,6 +516,7 @@ ExprPtr ExprParser::Expr(bool required, int precedence)
 ExprPtr ExprParser::Expr_P(bool required)
 {
   ExprPtr expr;
+  auto loc = lexer().loc;
 
   if(TOKEN(Integer)) {
     expr = new EInteger(lexer().intValue);
@@ -343,6 +530,9 @@ ExprPtr ExprParser::Expr_P(bool required)
     expr = new EString(lexer().strValue);
     lexer.Consume();
   }
+  else if(TOKEN(Interpolation)) {
+    expr = Interpolation();
+  }
   else if(TOKEN(True)) {
     expr = new EBoolean(true);
     lexer.Consume();
@@ -371,10 +561,26 @@ ExprPtr ExprParser::Expr_P(bool required)
     lexer.Consume();
     expr = While();
   }
+  else if(TOKEN(For)) {
+    lexer.Consume();
+    expr = For();
+  }
+  else if(TOKEN(Parallel)) {
+    lexer.Consume();
+    expr = Parallel();
+  }
   else if(TOKEN(Break)) {
     lexer.Consume();
     expr = Break();
   }
+  else if(TOKEN(Yield)) {
+    lexer.Consume();
+    expr = Yield();
+  }
+  else if(TOKEN(Region)) {
+    lexer.Consume();
+    expr = Region();
+  }
   else if(TOKEN(Return)) {
     lexer.Consume();
     expr = Return();
@@ -421,8 +627,10 @@ ExprPtr ExprParser::Expr_P(bool required)
     if(unaryOp == unaryOperators.end())
       ERROR("unknown unary operator: " << lexer().strValue)
 
-    expr = Expr(true, unaryOp->second);
-    expr = new ECall(new EVariable(unaryOp->first), expr);
+    // builtins always take their arguments as a list
+    auto list = make_unique<EList>();
+    list->exprs.push_back(Expr(true, unaryOp->second));
+    expr = new ECall(new EVariable(unaryOp->first), list.release());
   }
 
   if(!expr)
@@ -434,6 +642,9 @@ ExprPtr ExprParser::Expr_P(bool required)
     return expr;
   }
 
+  if(!expr->loc.source)
+    expr->loc = loc;
+
   if(TOKEN(Slash))
   {
     lexer.Consume();
@@ -450,6 +661,9 @@ ExprPtr ExprParser::TopLevel()
   while(true) {
     list->exprs.push_back(Expr());
 
+    if(Diagnostics::Current().Aborted())
+      return {};
+
     if(!TOKEN(Nodent))
       break;
     lexer.Consume();
@@ -6,6 +6,7 @@ namespace xra {
 class ExprParser
 {
   Lexer& lexer;
+  bool yielded; // a yield was parsed in the current function
 
   ExprPtr FlatBlock();
   ExprPtr Block();
@@ -17,7 +18,12 @@ class ExprParser
   ExprPtr Fn();
   ExprPtr If();
   ExprPtr While();
+  ExprPtr For();
+  ExprPtr Parallel();
   ExprPtr Break();
+  ExprPtr Yield();
+  ExprPtr Region();
+  ExprPtr Interpolation();
   ExprPtr Return();
   ExprPtr TypeAlias();
   ExprPtr Extern();
@@ -26,7 +32,8 @@ class ExprParser
 
 public:
   ExprParser(Lexer& lexer_) :
-    lexer(lexer_)
+    lexer(lexer_),
+    yielded(false)
   {}
 
   ExprPtr TopLevel();
@@ -5,6 +5,8 @@
 
 namespace xra {
 
+class VLocal;
+
 /*
  * Base expression
  */
@@ -102,13 +104,34 @@ public:
   EFunction(TypePtr param_, ExprPtr body_) :
     Expr(Kind_EFunction),
     param(move(param_)),
-    body(move(body_))
+    body(move(body_)),
+    generator(false),
+    loopBody(false),
+    escapes(true)
   {}
 
   CLASSOF(EFunction)
 
   TypePtr param;
   ExprPtr body;
+
+  // set by the parser
+  bool generator; // yields to the consumer passed as its last parameter
+  bool loopBody; // the consumer of a for over a generator; false stops it
+
+  struct Capture
+  {
+    string name;
+    VLocal* local; // kept alive by the EVariables referring to it
+  };
+
+  // locals of enclosing functions used here or in nested functions (filled by Infer)
+  vector<Capture> captures;
+
+  // filled by AnalyzeClosures
+  set<string> captured; // own locals that nested functions use
+  set<string> boxed; // captured locals that must outlive the frame
+  bool escapes; // the closure may be called after the creating frame returns
 };
 
 class ECall : public Expr
@@ -168,6 +191,26 @@ public:
   const TypePtr aliasedType;
 };
 
+// the operand of an annotation such as `fastmath`, which changes how an
+// expression is compiled but not what it is; otherwise the expression itself
+inline Expr* Unannotated(Expr* expr)
+{
+  auto call = dyn_cast<ECall>(expr);
+  if(!call)
+    return expr;
+
+  auto callee = dyn_cast<EVariable>(call->function.get());
+  auto& args = static_cast<EList&>(*call->argument).exprs;
+  if(callee && callee->name == "fastmath" && args.size() == 1)
+    return Unannotated(args[0].get());
+  return expr;
+}
+
+inline const Expr* Unannotated(const Expr* expr)
+{
+  return Unannotated(const_cast<Expr*>(expr));
+}
+
 } // namespace xra
 
 #endif // XRA_EXPR_HPP
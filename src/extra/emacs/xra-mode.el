@@ -1,8 +1,8 @@
 
 (defvar xra-keywords
   (regexp-opt '("module" "using" "fn" "if"
-                "else" "elsif" "while" "break"
-                "return" "type" "extern" "macro"
+                "else" "elsif" "while" "for" "in" "by" "parallel" "break"
+                "yield" "region" "return" "type" "extern" "macro"
                 "unsigned" "signed") 'words)
   "xra keywords")
 
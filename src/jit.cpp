@@ -0,0 +1,49 @@
+#include "common.hpp"
+#include "backend.hpp"
+#include "runtime.hpp"
+#include <llvm/Support/DynamicLibrary.h>
+
+namespace xra {
+
+// compiled code reaches the runtime linked into the compiler
+static void RegisterRuntime()
+{
+  llvm::sys::DynamicLibrary::AddSymbol("xra_parallel_for", (void*)&xra_parallel_for);
+  llvm::sys::DynamicLibrary::AddSymbol("xra_region_push", (void*)&xra_region_push);
+  llvm::sys::DynamicLibrary::AddSymbol("xra_region_pop", (void*)&xra_region_pop);
+  llvm::sys::DynamicLibrary::AddSymbol("xra_alloc", (void*)&xra_alloc);
+  llvm::sys::DynamicLibrary::AddSymbol("xra_string_concat", (void*)&xra_string_concat);
+  llvm::sys::DynamicLibrary::AddSymbol("xra_string_compare", (void*)&xra_string_compare);
+  llvm::sys::DynamicLibrary::AddSymbol("xra_string_cstr", (void*)&xra_string_cstr);
+  llvm::sys::DynamicLibrary::AddSymbol("xra_format_int", (void*)&xra_format_int);
+  llvm::sys::DynamicLibrary::AddSymbol("xra_format_uint", (void*)&xra_format_uint);
+  llvm::sys::DynamicLibrary::AddSymbol("xra_format_float", (void*)&xra_format_float);
+}
+
+unique_ptr<llvm::ExecutionEngine> CreateJIT(llvm::Module* module, const BackendOptions& options, string& err)
+{
+  RegisterRuntime();
+
+  llvm::EngineBuilder builder(module);
+  builder.setEngineKind(llvm::EngineKind::JIT);
+  builder.setErrorStr(&err);
+  builder.setOptLevel(GetCodeGenOptLevel(options));
+  builder.setMCPU(GetTargetCPU(options));
+  builder.setMAttrs(GetTargetFeatures(options));
+  builder.setTargetOptions(GetTargetOptions(options));
+
+  unique_ptr<llvm::ExecutionEngine> engine(builder.create());
+  if(!engine)
+    return {};
+
+  // when lazy, only main is compiled up front; every other function is
+  // reached through a stub that compiles it on its first call. The stubs
+  // are not safe to run from several threads, which parallel loops and the
+  // tiering worker do, so those modules are always compiled eagerly.
+  bool lazy = options.lazyJIT && !options.tiered && !module->getFunction("xra_parallel_for");
+  engine->DisableLazyCompilation(!lazy);
+
+  return engine;
+}
+
+} // namespace xra
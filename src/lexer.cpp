@@ -62,6 +62,11 @@ ostream& operator<<(ostream& os, const Token& token)
       EscapeString(token.strValue, os);
       os << "\"";
       break;
+    case Token::Interpolation:
+      os << "<interpolation " << token.intValue << " \"";
+      EscapeString(token.strValue, os);
+      os << "\">";
+      break;
     // special identifiers
     case Token::BooleanType:
       os << "bool";
@@ -108,9 +113,27 @@ ostream& operator<<(ostream& os, const Token& token)
     case Token::While:
       os << "while";
       break;
+    case Token::For:
+      os << "for";
+      break;
+    case Token::In:
+      os << "in";
+      break;
+    case Token::By:
+      os << "by";
+      break;
+    case Token::Parallel:
+      os << "parallel";
+      break;
     case Token::Break:
       os << "break";
       break;
+    case Token::Yield:
+      os << "yield";
+      break;
+    case Token::Region:
+      os << "region";
+      break;
     case Token::Return:
       os << "return";
       break;
@@ -303,7 +326,13 @@ void Lexer::NextToken()
     if(str == "elsif") return MakeToken(Token::Elsif);
     if(str == "else") return MakeToken(Token::Else);
     if(str == "while") return MakeToken(Token::While);
+    if(str == "for") return MakeToken(Token::For);
+    if(str == "in") return MakeToken(Token::In);
+    if(str == "by") return MakeToken(Token::By);
+    if(str == "parallel") return MakeToken(Token::Parallel);
     if(str == "break") return MakeToken(Token::Break);
+    if(str == "yield") return MakeToken(Token::Yield);
+    if(str == "region") return MakeToken(Token::Region);
     if(str == "return") return MakeToken(Token::Return);
     if(str == "type") return MakeToken(Token::TypeAlias);
     if(str == "extern") return MakeToken(Token::Extern);
@@ -405,7 +434,7 @@ void Lexer::String()
   }
 
   string str;
-  vector<pair<size_t,  string> > interpolations;
+  vector<pair<string, string> > interpolations; // the text before each slot, and its code
 
   while(true)
   {
@@ -456,7 +485,8 @@ void Lexer::String()
         if(lastChar == '}') delimLevel--;
       }
       interp.resize(interp.size() - 1);
-      interpolations.push_back({str.size(), move(interp)});
+      interpolations.push_back({move(str), move(interp)});
+      str.clear();
     }
     else if(lastChar == EOF)
     {
@@ -468,54 +498,29 @@ void Lexer::String()
     }
   }
 
-  if(delim == '/' || !interpolations.empty())
-    MakeToken(Token::OpenParen);
-
   // leading regex desugar
   if(delim == '/')
   {
+    MakeToken(Token::OpenParen);
     MakeIdentifier("Regex");
     MakeToken(Token::OpenParen);
   }
 
-  // leading interpolation desugar
-  if(!interpolations.empty())
+  if(interpolations.empty())
   {
-    size_t i = 0;
-    while(true) {
-      i = str.find_first_of("{}", i);
-      if(i == string::npos)
-        break;
-      for(auto& interp : interpolations) {
-        if(interp.first > i)
-          interp.first++;
-      }
-      str.insert(i, 1, str[i]);
-      i += 2;
-    }
-
-    for(i = interpolations.size(); i > 0; i--) {
-      stringstream ss;
-      ss << "{" << (i - 1) << "}";
-      str.insert(interpolations[i - 1].first, ss.str());
-    }
-
-    MakeIdentifier("String");
-    MakeOperator(".");
-    MakeIdentifier("format");
-    MakeToken(Token::OpenParen);
+    MakeToken(Token::String);
+    tokens.front().strValue = move(str);
   }
-
-  MakeToken(Token::String);
-  tokens.front().strValue = move(str);
-
-  // trailing interpolation desugar
-  if(!interpolations.empty())
+  else
   {
-    for(auto& interp : interpolations) {
-      MakeOperator(",");
+    // each slot's code follows in parentheses, then the text after it
+    MakeToken(Token::Interpolation);
+    tokens.front().strValue = move(interpolations[0].first);
+    tokens.front().intValue = interpolations.size();
+
+    for(size_t i = 0; i < interpolations.size(); i++) {
       MakeToken(Token::OpenParen);
-      stringstream ss(interp.second);
+      stringstream ss(interpolations[i].second);
       Lexer lexer(ss, "interpolation");
       while(true) {
         if(lexer().type == Token::EndOfFile)
@@ -525,8 +530,10 @@ void Lexer::String()
         lexer.Consume();
       }
       MakeToken(Token::CloseParen);
+
+      MakeToken(Token::String);
+      tokens.front().strValue = i + 1 < interpolations.size() ? move(interpolations[i + 1].first) : move(str);
     }
-    MakeToken(Token::CloseParen);
   }
 
   // trailing regex desugar
@@ -555,10 +562,8 @@ void Lexer::String()
       GetChar();
     }
     MakeToken(Token::CloseParen);
-  }
-
-  if(delim == '/' || !interpolations.empty())
     MakeToken(Token::CloseParen);
+  }
 }
 
 void Lexer::Number()
@@ -586,7 +591,8 @@ void Lexer::Number()
   while(isalnum(GetChar()))
     s += lastChar;
 
-  if(lastChar != '.') {
+  // the dot of a range (0..n) does not start a fraction
+  if(lastChar != '.' || inputStream.peek() == '.') {
     for(char c : s) {
       if(c >= '0' && c < ('0' + min(base, 10)))
         continue;
@@ -17,6 +17,7 @@ struct Token
     Integer, // intValue
     Float, // floatValue
     String, // strValue
+    Interpolation, // strValue, intValue: the text before the first slot, and the number of slots
     // special identifiers
     BooleanType,
     IntegerType,
@@ -33,7 +34,13 @@ struct Token
     Elsif,
     Else,
     While,
+    For,
+    In,
+    By,
+    Parallel,
     Break,
+    Yield,
+    Region,
     Return,
     TypeAlias,
     Extern,
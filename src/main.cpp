@@ -3,7 +3,9 @@
 #include "expr-parser.hpp"
 #include "typechecker.hpp"
 #include "compiler.hpp"
+#include "backend.hpp"
 
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <cstring>
@@ -11,21 +13,36 @@
 
 using namespace xra;
 
+static bool EndsWith(const string& str, const string& suffix)
+{
+  return str.size() >= suffix.size() &&
+    str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
 int main(int argc, char** argv)
 {
   llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
 
-  enum Mode { LexMode, ParseMode, AnalyzeMode, CompileMode, ExecMode };
+  enum Mode { LexMode, ParseMode, AnalyzeMode, CompileMode, ExecMode, LinkMode };
   Mode mode = ExecMode;
 
   ifstream ifs;
   ofstream ofs;
+  string outputPath;
   string source = "stdin";
   bool bitcode = false;
+  bool reportTimes = false;
+  BackendOptions backendOptions;
+  if(auto cacheDir = getenv("XRA_CACHE_DIR"))
+    backendOptions.cacheDir = cacheDir;
+
+  Diagnostics diags;
+  Diagnostics::Scope diagsScope(diags);
 
   // parse options
   int c;
-  while((c = getopt(argc, argv, "lpacemo:b")) != -1) {
+  while((c = getopt(argc, argv, "lpaceo:bf:m:O:tC:")) != -1) {
     switch(c) {
     case 'l':
       mode = LexMode;
@@ -43,15 +60,84 @@ int main(int argc, char** argv)
       mode = ExecMode;
       break;
     case 'o':
-      ofs.open(optarg);
-      if(!ofs) {
-        cerr << "could not open output file " << optarg << endl;
-        return EXIT_FAILURE;
-      }
+      outputPath = optarg;
       break;
     case 'b':
       bitcode = true;
       break;
+    case 'f':
+      if(strncmp(optarg, "error-limit=", 12) == 0) {
+        diags.SetErrorLimit(strtoul(optarg + 12, nullptr, 10));
+      }
+      else if(strcmp(optarg, "lazy-jit") == 0 || strcmp(optarg, "no-lazy-jit") == 0) {
+        backendOptions.lazyJIT = (optarg[0] != 'n');
+      }
+      else if(strcmp(optarg, "tiered") == 0 || strcmp(optarg, "no-tiered") == 0) {
+        backendOptions.tiered = (optarg[0] != 'n');
+      }
+      else if(strncmp(optarg, "tier-threshold=", 15) == 0) {
+        backendOptions.tierThreshold = (unsigned int)strtoul(optarg + 15, nullptr, 10);
+      }
+      else if(strcmp(optarg, "fast-math") == 0 || strcmp(optarg, "no-fast-math") == 0) {
+        backendOptions.fastMath = (optarg[0] != 'n');
+      }
+      else if(strcmp(optarg, "const-eval") == 0 || strcmp(optarg, "no-const-eval") == 0) {
+        backendOptions.constEval = (optarg[0] != 'n');
+      }
+      else if(strncmp(optarg, "specialize-budget=", 18) == 0) {
+        backendOptions.specializeBudget = (size_t)strtoul(optarg + 18, nullptr, 10);
+      }
+      else if(strncmp(optarg, "cache-limit=", 12) == 0) {
+        backendOptions.cacheLimit = (size_t)strtoul(optarg + 12, nullptr, 10) << 20;
+      }
+      else {
+        cerr << "unknown option -f" << optarg << endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'm':
+      if(strncmp(optarg, "arch=", 5) == 0) {
+        backendOptions.cpu = optarg + 5;
+      }
+      else if(strncmp(optarg, "attr=", 5) == 0) {
+        backendOptions.features = optarg + 5;
+      }
+      else {
+        cerr << "unknown option -m" << optarg << endl;
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'O':
+      if(optarg[0] < '0' || optarg[0] > '3' || optarg[1] != '\0') {
+        cerr << "invalid optimization level -O" << optarg << endl;
+        return EXIT_FAILURE;
+      }
+      backendOptions.optLevel = (unsigned int)(optarg[0] - '0');
+      break;
+    case 't':
+      reportTimes = true;
+      break;
+    case 'C':
+      backendOptions.cacheDir = optarg;
+      break;
+    }
+  }
+
+  // -o without -c links an executable, -c -o file.o writes a native object
+  if(mode == ExecMode && !outputPath.empty())
+    mode = LinkMode;
+  bool native = (mode == LinkMode) || (mode == CompileMode && EndsWith(outputPath, ".o"));
+
+  // code run in this process can use everything the host has; files
+  // written for elsewhere stay generic unless -march says otherwise
+  if(mode == ExecMode && backendOptions.cpu.empty())
+    backendOptions.cpu = "native";
+
+  if(!outputPath.empty() && !native) {
+    ofs.open(outputPath);
+    if(!ofs) {
+      cerr << "could not open output file " << outputPath << endl;
+      return EXIT_FAILURE;
     }
   }
 
@@ -100,9 +186,8 @@ int main(int argc, char** argv)
   ExprParser exprParser(lexer);
   ExprPtr expr = exprParser.TopLevel();
 
-  string errors = Error::Get();
-  if(!errors.empty()) {
-    cerr << errors;
+  diags.Flush(cerr);
+  if(diags.ErrorCount() != 0) {
     cerr << "parsing failed" << endl;
     return EXIT_FAILURE;
   }
@@ -121,9 +206,8 @@ int main(int argc, char** argv)
   AddBuiltins(checker.env);
   checker.Visit(expr.get());
 
-  errors = Error::Get();
-  if(!errors.empty()) {
-    cerr << errors;
+  diags.Flush(cerr);
+  if(diags.ErrorCount() != 0) {
     cerr << "analysis failed" << endl;
     return EXIT_FAILURE;
   }
@@ -138,15 +222,75 @@ int main(int argc, char** argv)
    */
   auto module = make_unique<llvm::Module>(source, llvm::getGlobalContext());
 
+  AnalyzeClosures(*expr);
+
   Compiler compiler(*module);
+  compiler.fastMath = backendOptions.fastMath;
+  compiler.foldConstants = backendOptions.constEval;
   compiler.Visit(expr.get());
+  FoldConstants(*module, compiler.constantHelpers, backendOptions);
 
+  // native objects get a C main, whether linked here or by the user
   auto mainFunc = module->begin();
-
-  if(mode == CompileMode) {
+  if(native) {
+    CreateEntryPoint(*module, *mainFunc);
+  }
+  else {
     mainFunc->setName("main");
     mainFunc->setLinkage(llvm::Function::ExternalLinkage);
+  }
 
+  typedef void (*MainFunc)();
+
+  /*
+   * Cached execution: reuse a previously compiled shared object for the same module
+   */
+  if(mode == ExecMode && !backendOptions.cacheDir.empty()) {
+    mainFunc->setName("xra.main");
+
+    string err;
+    bool hit = false;
+    auto mainFuncPtr = (MainFunc)(uintptr_t)LoadCachedFunction(*module, "xra.main", backendOptions, hit, err);
+    if(mainFuncPtr) {
+      if(reportTimes)
+        cerr << "object cache " << (hit ? "hit" : "miss") << endl;
+      mainFuncPtr();
+      return EXIT_SUCCESS;
+    }
+
+    // fall back to the JIT
+    cerr << "object cache unavailable: " << err << endl;
+  }
+
+  // tiered execution starts everything at -O0 and reoptimizes hot functions
+  unique_ptr<Tiering> tiering;
+  if(mode == ExecMode && backendOptions.tiered) {
+    backendOptions.optLevel = 0;
+    tiering = make_unique<Tiering>(*module, *mainFunc, backendOptions);
+  }
+
+  /*
+   * Optimization
+   */
+  auto optStart = chrono::steady_clock::now();
+  Optimize(*module, backendOptions);
+  if(reportTimes) {
+    auto optTime = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - optStart);
+    cerr << "optimization (-O" << backendOptions.optLevel << ") took "
+         << (double)optTime.count() / 1000.0 << " ms" << endl;
+  }
+
+  if(mode == CompileMode && native) {
+    string err;
+    if(!EmitObjectFile(*module, outputPath, backendOptions, err)) {
+      cerr << "failed to write object file: " << err << endl;
+      return EXIT_FAILURE;
+    }
+    cerr << "compilation ok" << endl;
+    return EXIT_SUCCESS;
+  }
+
+  if(mode == CompileMode) {
     llvm::raw_os_ostream llvmos(outputStream);
     if(bitcode) {
       if(!ofs.is_open()) {
@@ -163,22 +307,48 @@ int main(int argc, char** argv)
   }
 
   /*
-   * Execution
+   * Linking
    */
-  llvm::EngineBuilder builder(module.release());
+  if(mode == LinkMode) {
+    char objectPath[] = "/tmp/xra-XXXXXX.o";
+    int fd = mkstemps(objectPath, 2);
+    if(fd < 0) {
+      cerr << "could not create temporary object file" << endl;
+      return EXIT_FAILURE;
+    }
+    close(fd);
 
-  string err;
-  builder.setErrorStr(&err);
+    string err;
+    bool ok = EmitObjectFile(*module, objectPath, backendOptions, err) &&
+      LinkExecutable(objectPath, outputPath, err);
+    unlink(objectPath);
 
-  unique_ptr<llvm::ExecutionEngine> engine(builder.create());
+    if(!ok) {
+      cerr << "linking failed: " << err << endl;
+      return EXIT_FAILURE;
+    }
+    cerr << "linking ok" << endl;
+    return EXIT_SUCCESS;
+  }
+
+  /*
+   * Execution
+   */
+  string err;
+  auto engine = CreateJIT(module.release(), backendOptions, err);
   if(!engine) {
     cerr << "failed to create execution engine: " << err << endl;
     return EXIT_FAILURE;
   }
 
-  typedef void (*MainFunc)();
+  if(tiering)
+    tiering->Start(*engine);
+
   auto mainFuncPtr = (MainFunc)(uintptr_t)engine->getPointerToFunction(mainFunc);
   mainFuncPtr();
 
+  // stop the background compiler before the engine goes away
+  tiering.reset();
+
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,212 @@
+#include "common.hpp"
+#include "backend.hpp"
+#include <llvm/DataLayout.h>
+#include <llvm/PassManager.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/FormattedStream.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace xra {
+
+llvm::CodeGenOpt::Level GetCodeGenOptLevel(const BackendOptions& options)
+{
+  switch(options.optLevel) {
+  case 0: return llvm::CodeGenOpt::None;
+  case 1: return llvm::CodeGenOpt::Less;
+  case 2: return llvm::CodeGenOpt::Default;
+  default: return llvm::CodeGenOpt::Aggressive;
+  }
+}
+
+string GetTargetCPU(const BackendOptions& options)
+{
+  if(options.cpu == "native")
+    return llvm::sys::getHostCPUName();
+  return options.cpu;
+}
+
+vector<string> GetTargetFeatures(const BackendOptions& options)
+{
+  vector<string> features;
+
+  // some hosts only report a CPU name, which already implies its features
+  llvm::StringMap<bool> hostFeatures;
+  if(options.cpu == "native" && llvm::sys::getHostCPUFeatures(hostFeatures)) {
+    for(auto& feature : hostFeatures)
+      features.push_back((feature.getValue() ? "+" : "-") + feature.getKey().str());
+    sort(features.begin(), features.end());
+  }
+
+  // explicit -mattr entries come last so they override the host
+  size_t start = 0;
+  while(start < options.features.size()) {
+    size_t end = options.features.find(',', start);
+    if(end == string::npos)
+      end = options.features.size();
+    if(end > start)
+      features.push_back(options.features.substr(start, end - start));
+    start = end + 1;
+  }
+
+  return features;
+}
+
+llvm::TargetOptions GetTargetOptions(const BackendOptions& options)
+{
+  llvm::TargetOptions targetOptions;
+  if(options.fastMath) {
+    targetOptions.UnsafeFPMath = true;
+    targetOptions.NoInfsFPMath = true;
+    targetOptions.NoNaNsFPMath = true;
+    targetOptions.AllowFPOpFusion = llvm::FPOpFusion::Fast;
+  }
+  return targetOptions;
+}
+
+unique_ptr<llvm::TargetMachine> CreateTargetMachine(const BackendOptions& options, string& err)
+{
+  auto triple = llvm::sys::getDefaultTargetTriple();
+
+  auto target = llvm::TargetRegistry::lookupTarget(triple, err);
+  if(!target)
+    return {};
+
+  string features;
+  for(auto& feature : GetTargetFeatures(options)) {
+    if(!features.empty())
+      features += ",";
+    features += feature;
+  }
+
+  auto machine = target->createTargetMachine(triple, GetTargetCPU(options), features, GetTargetOptions(options),
+                                             llvm::Reloc::PIC_, llvm::CodeModel::Default,
+                                             GetCodeGenOptLevel(options));
+  if(!machine)
+    err = "could not create target machine for " + triple;
+
+  return unique_ptr<llvm::TargetMachine>(machine);
+}
+
+bool EmitObjectFile(llvm::Module& module, const string& path, const BackendOptions& options, string& err)
+{
+  auto machine = CreateTargetMachine(options, err);
+  if(!machine)
+    return false;
+
+  module.setTargetTriple(machine->getTargetTriple());
+  module.setDataLayout(machine->getDataLayout()->getStringRepresentation());
+
+  llvm::raw_fd_ostream os(path.c_str(), err, llvm::raw_fd_ostream::F_Binary);
+  if(!err.empty())
+    return false;
+  llvm::formatted_raw_ostream fos(os);
+
+  llvm::PassManager passes;
+  passes.add(new llvm::DataLayout(*machine->getDataLayout()));
+  if(machine->addPassesToEmitFile(passes, fos, llvm::TargetMachine::CGFT_ObjectFile)) {
+    err = "target does not support object file emission";
+    return false;
+  }
+  passes.run(module);
+
+  return true;
+}
+
+llvm::Function* CreateEntryPoint(llvm::Module& module, llvm::Function& xraMain)
+{
+  auto& ctx = module.getContext();
+
+  xraMain.setName("xra.main");
+  xraMain.setLinkage(llvm::Function::InternalLinkage);
+
+  auto mainType = llvm::FunctionType::get(llvm::Type::getInt32Ty(ctx), false);
+  auto mainFunc = llvm::Function::Create(mainType, llvm::Function::ExternalLinkage, "main", &module);
+
+  llvm::IRBuilder<> builder(llvm::BasicBlock::Create(ctx, "entry", mainFunc));
+  builder.CreateCall(&xraMain);
+  builder.CreateRet(builder.getInt32(0));
+
+  return mainFunc;
+}
+
+static bool Run(const vector<string>& args, string& err)
+{
+  vector<char*> argv;
+  for(auto& arg : args)
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  pid_t pid = fork();
+  if(pid < 0) {
+    err = "could not fork " + args[0];
+    return false;
+  }
+
+  if(pid == 0) {
+    execvp(argv[0], argv.data());
+    _exit(127);
+  }
+
+  int status;
+  if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    err = args[0] + " failed";
+    return false;
+  }
+
+  return true;
+}
+
+// libxra-runtime.a is built next to the compiler
+static string RuntimeLibraryPath()
+{
+  char path[PATH_MAX];
+  auto length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if(length <= 0)
+    return "libxra-runtime.a";
+
+  string compilerPath(path, size_t(length));
+  return compilerPath.substr(0, compilerPath.rfind('/') + 1) + "libxra-runtime.a";
+}
+
+bool LinkExecutable(const string& objectPath, const string& outputPath, string& err)
+{
+  const char* linker = getenv("CC");
+
+  vector<string> args;
+  args.push_back(linker ? linker : "cc");
+  args.push_back("-o");
+  args.push_back(outputPath);
+  args.push_back(objectPath);
+  args.push_back(RuntimeLibraryPath());
+  args.push_back("-lstdc++");
+  args.push_back("-lpthread");
+
+  return Run(args, err);
+}
+
+bool LinkSharedObject(const string& objectPath, const string& outputPath, string& err)
+{
+  const char* linker = getenv("CC");
+
+  vector<string> args;
+  args.push_back(linker ? linker : "cc");
+  args.push_back("-shared");
+  args.push_back("-o");
+  args.push_back(outputPath);
+  args.push_back(objectPath);
+  args.push_back(RuntimeLibraryPath());
+  args.push_back("-lstdc++");
+  args.push_back("-lpthread");
+
+  return Run(args, err);
+}
+
+} // namespace xra
@@ -0,0 +1,97 @@
+#include "common.hpp"
+#include "backend.hpp"
+#include <llvm/DataLayout.h>
+#include <llvm/PassManager.h>
+#include <llvm/Target/TargetMachine.h>
+#if LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR < 3
+#include <llvm/TargetTransformInfo.h>
+#endif
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/Scalar.h>
+
+namespace xra {
+
+// Locals live in entry-block allocas; promoting them is the one pass run
+// at every level, so loop-carried locals are SSA phis even at -O0.
+static void PromoteSlots(llvm::Module& module)
+{
+  llvm::FunctionPassManager passes(&module);
+  passes.add(llvm::createPromoteMemoryToRegisterPass());
+
+  passes.doInitialization();
+  for(auto& func : module) {
+    if(!func.isDeclaration())
+      passes.run(func);
+  }
+  passes.doFinalization();
+}
+
+void Optimize(llvm::Module& module, const BackendOptions& options)
+{
+  if(options.optLevel == 0) {
+    PromoteSlots(module);
+    return;
+  }
+
+  llvm::PassManagerBuilder builder;
+  builder.OptLevel = options.optLevel;
+  builder.SizeLevel = 0;
+  builder.DisableUnrollLoops = (options.optLevel < 2);
+
+  if(options.optLevel > 1)
+    builder.Inliner = llvm::createFunctionInliningPass(options.optLevel > 2 ? 275 : 225);
+  else
+    builder.Inliner = llvm::createAlwaysInlinerPass();
+
+  // vector widths and costs come from the target machine's analysis passes
+  builder.LoopVectorize = (options.optLevel > 1);
+#if LLVM_VERSION_MAJOR > 3 || LLVM_VERSION_MINOR >= 3
+  builder.SLPVectorize = (options.optLevel > 1);
+#else
+  builder.Vectorize = (options.optLevel > 2);
+#endif
+
+  string err;
+  auto machine = CreateTargetMachine(options, err);
+  if(machine) {
+    module.setTargetTriple(machine->getTargetTriple());
+    module.setDataLayout(machine->getDataLayout()->getStringRepresentation());
+  }
+
+  auto addAnalysisPasses = [&](llvm::PassManagerBase& passes) {
+    if(!machine)
+      return;
+    passes.add(new llvm::DataLayout(*machine->getDataLayout()));
+#if LLVM_VERSION_MAJOR > 3 || LLVM_VERSION_MINOR >= 3
+    machine->addAnalysisPasses(passes);
+#else
+    passes.add(new llvm::TargetTransformInfo(machine->getScalarTargetTransformInfo(),
+                                             machine->getVectorTargetTransformInfo()));
+#endif
+  };
+
+  // per-function cleanup (sroa/mem2reg, early cse, ...)
+  llvm::FunctionPassManager functionPasses(&module);
+  addAnalysisPasses(functionPasses);
+  builder.populateFunctionPassManager(functionPasses);
+
+  functionPasses.doInitialization();
+  for(auto& func : module) {
+    if(!func.isDeclaration())
+      functionPasses.run(func);
+  }
+  functionPasses.doFinalization();
+
+  // cloned before inlining, which would otherwise copy the general version
+  if(options.optLevel > 1)
+    Specialize(module, options.specializeBudget);
+
+  // the full pipeline (inliner, instcombine, gvn, licm, loop passes, vectorizers, ...)
+  llvm::PassManager modulePasses;
+  addAnalysisPasses(modulePasses);
+  builder.populateModulePassManager(modulePasses);
+  modulePasses.run(module);
+}
+
+} // namespace xra
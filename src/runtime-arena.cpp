@@ -0,0 +1,128 @@
+#include "runtime.hpp"
+#include <cstdlib>
+
+namespace xra {
+
+/*
+ * Region allocation. Each thread has a stack of regions; xra_alloc bumps a
+ * pointer through the blocks of the innermost one, and popping a region
+ * releases all of its blocks at once. Standard-sized blocks are kept for
+ * the next region instead of going back to malloc, so a region entered
+ * once per request settles into allocating without any calls at all.
+ * Outside of every region xra_alloc is plain malloc, and the memory lives
+ * for the rest of the program.
+ */
+
+namespace {
+
+const size_t BlockSize = 64 << 10;
+const size_t Alignment = 16;
+const size_t MaxSpareBlocks = 16;
+
+struct Block
+{
+  Block* previous;
+  size_t size; // usable bytes after the header
+};
+
+struct Region
+{
+  Region* parent;
+  Block* blocks; // the current block, linked to the ones filled before it
+  char* next;
+  char* end;
+};
+
+// the header is padded so the memory after it stays aligned
+const size_t HeaderSize = (sizeof(Block) + Alignment - 1) & ~(Alignment - 1);
+
+thread_local Region* current = nullptr;
+thread_local Block* spareBlocks = nullptr;
+thread_local size_t spareCount = 0;
+
+Block* NewBlock(size_t size)
+{
+  if(size <= BlockSize && spareBlocks) {
+    auto block = spareBlocks;
+    spareBlocks = block->previous;
+    spareCount--;
+    return block;
+  }
+
+  size = size <= BlockSize ? BlockSize : size;
+  auto block = static_cast<Block*>(malloc(HeaderSize + size));
+  if(!block)
+    abort();
+  block->size = size;
+  return block;
+}
+
+void FreeBlock(Block* block)
+{
+  if(block->size == BlockSize && spareCount < MaxSpareBlocks) {
+    block->previous = spareBlocks;
+    spareBlocks = block;
+    spareCount++;
+  }
+  else {
+    free(block);
+  }
+}
+
+// starts a new block big enough for size bytes and allocates them from it
+void* Grow(Region& region, size_t size)
+{
+  auto block = NewBlock(size);
+  block->previous = region.blocks;
+  region.blocks = block;
+
+  auto memory = reinterpret_cast<char*>(block) + HeaderSize;
+  region.next = memory + size;
+  region.end = memory + block->size;
+  return memory;
+}
+
+} // namespace
+
+} // namespace xra
+
+void xra_region_push()
+{
+  auto region = static_cast<xra::Region*>(malloc(sizeof(xra::Region)));
+  if(!region)
+    abort();
+
+  region->parent = xra::current;
+  region->blocks = nullptr;
+  region->next = nullptr;
+  region->end = nullptr;
+  xra::current = region;
+}
+
+void xra_region_pop()
+{
+  auto region = xra::current;
+  xra::current = region->parent;
+
+  for(auto block = region->blocks; block;) {
+    auto previous = block->previous;
+    xra::FreeBlock(block);
+    block = previous;
+  }
+  free(region);
+}
+
+void* xra_alloc(int64_t size)
+{
+  auto region = xra::current;
+  if(!region)
+    return malloc(size_t(size));
+
+  auto rounded = (size_t(size) + xra::Alignment - 1) & ~(xra::Alignment - 1);
+  if(size_t(region->end - region->next) < rounded)
+    return xra::Grow(*region, rounded);
+
+  auto memory = region->next;
+  region->next += rounded;
+  return memory;
+}
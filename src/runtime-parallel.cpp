@@ -0,0 +1,237 @@
+#include "runtime.hpp"
+#include <condition_variable>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xra {
+
+using namespace std;
+
+/*
+ * The thread pool behind parallel for. It starts on the first parallel loop
+ * with a worker per hardware thread (or XRA_THREADS), the calling thread
+ * being worker 0. Each loop deals the chunk indices out in equal contiguous
+ * ranges; a worker runs chunks from the front of its own range and, once
+ * that is empty, steals the back half of another's. Which thread runs a
+ * chunk has no effect on the results, since chunks write nothing shared
+ * but their own slot of a reduction.
+ */
+
+namespace {
+
+typedef void (*ChunkFunction)(void*, int64_t);
+
+// set on pool threads, and on the caller while it works on a loop; a loop
+// started there runs on that thread alone instead of waiting on the pool
+thread_local bool insideLoop = false;
+
+// the chunks a worker has yet to run
+struct WorkRange
+{
+  WorkRange() :
+    begin(0),
+    end(0)
+  {}
+
+  mutex lock;
+  int64_t begin;
+  int64_t end;
+};
+
+class ThreadPool
+{
+public:
+  explicit ThreadPool(size_t size);
+  ~ThreadPool();
+
+  void Run(int64_t chunks, ChunkFunction, void* context);
+
+private:
+  void WorkerMain(size_t self);
+  void Work(size_t self);
+  bool Take(size_t self, int64_t& chunk);
+  bool Steal(size_t self);
+
+  vector<unique_ptr<WorkRange>> ranges; // one per worker, the caller's first
+  vector<thread> threads;
+
+  mutex submitLock; // held for the whole of a loop
+  mutex stateLock; // guards everything below
+  condition_variable wake;
+  condition_variable done;
+  uint64_t generation; // counts loops, so workers notice a new one
+  size_t busy; // pool threads still working on the current loop
+  bool stopping;
+  ChunkFunction function;
+  void* context;
+};
+
+ThreadPool::ThreadPool(size_t size) :
+  generation(0),
+  busy(0),
+  stopping(false),
+  function(nullptr),
+  context(nullptr)
+{
+  for(size_t i = 0; i < size; i++)
+    ranges.push_back(unique_ptr<WorkRange>(new WorkRange));
+  for(size_t i = 1; i < size; i++)
+    threads.push_back(thread(&ThreadPool::WorkerMain, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    lock_guard<mutex> state(stateLock);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  for(auto& t : threads)
+    t.join();
+}
+
+void ThreadPool::Run(int64_t chunks, ChunkFunction function_, void* context_)
+{
+  lock_guard<mutex> submit(submitLock);
+
+  {
+    lock_guard<mutex> state(stateLock);
+    function = function_;
+    context = context_;
+
+    // the first chunks % size workers get one chunk more
+    auto size = int64_t(ranges.size());
+    int64_t begin = 0;
+    for(int64_t i = 0; i < size; i++) {
+      auto& range = *ranges[size_t(i)];
+      lock_guard<mutex> guard(range.lock);
+      range.begin = begin;
+      range.end = begin + chunks / size + (i < chunks % size ? 1 : 0);
+      begin = range.end;
+    }
+
+    busy = threads.size();
+    generation++;
+  }
+  wake.notify_all();
+
+  insideLoop = true;
+  Work(0);
+  insideLoop = false;
+
+  unique_lock<mutex> state(stateLock);
+  done.wait(state, [this] { return busy == 0; });
+}
+
+void ThreadPool::WorkerMain(size_t self)
+{
+  insideLoop = true;
+
+  uint64_t seen = 0;
+  while(true) {
+    {
+      unique_lock<mutex> state(stateLock);
+      wake.wait(state, [this, seen] { return stopping || generation != seen; });
+      if(stopping)
+        return;
+      seen = generation;
+    }
+
+    Work(self);
+
+    lock_guard<mutex> state(stateLock);
+    if(--busy == 0)
+      done.notify_one();
+  }
+}
+
+void ThreadPool::Work(size_t self)
+{
+  while(true) {
+    int64_t chunk;
+    if(Take(self, chunk))
+      function(context, chunk);
+    else if(!Steal(self))
+      return;
+  }
+}
+
+bool ThreadPool::Take(size_t self, int64_t& chunk)
+{
+  auto& own = *ranges[self];
+  lock_guard<mutex> guard(own.lock);
+  if(own.begin >= own.end)
+    return false;
+
+  chunk = own.begin++;
+  return true;
+}
+
+// moves the back half of the first nonempty range after ours into ours;
+// false once every other range is empty
+bool ThreadPool::Steal(size_t self)
+{
+  for(size_t i = 1; i < ranges.size(); i++) {
+    auto& victim = *ranges[(self + i) % ranges.size()];
+    int64_t begin, end;
+    {
+      lock_guard<mutex> guard(victim.lock);
+      int64_t left = victim.end - victim.begin;
+      if(left <= 0)
+        continue;
+
+      // rounding up lets a thief take the last chunk of a busy worker
+      end = victim.end;
+      begin = end - (left + 1) / 2;
+      victim.end = begin;
+    }
+
+    auto& own = *ranges[self];
+    lock_guard<mutex> guard(own.lock);
+    own.begin = begin;
+    own.end = end;
+    return true;
+  }
+
+  return false;
+}
+
+size_t ThreadCount()
+{
+  if(auto threads = getenv("XRA_THREADS")) {
+    long count = strtol(threads, nullptr, 10);
+    if(count > 0)
+      return size_t(count);
+  }
+
+  unsigned int count = thread::hardware_concurrency();
+  return count ? count : 1;
+}
+
+ThreadPool& Pool()
+{
+  static ThreadPool pool(ThreadCount());
+  return pool;
+}
+
+} // namespace
+
+} // namespace xra
+
+void xra_parallel_for(int64_t chunks, void (*body)(void*, int64_t), void* context)
+{
+  if(chunks <= 0)
+    return;
+
+  if(chunks == 1 || xra::insideLoop) {
+    for(int64_t i = 0; i < chunks; i++)
+      body(context, i);
+    return;
+  }
+
+  xra::Pool().Run(chunks, body, context);
+}
@@ -0,0 +1,98 @@
+#include "runtime.hpp"
+#include <cstdio>
+#include <cstring>
+
+/*
+ * String operations too big to inline. Strings are {data, length} pairs
+ * that never change once made, so these only ever build new data: a
+ * concatenation with an empty side returns the other side's data as it is,
+ * and new data is allocated with xra_alloc and followed by a NUL so it can
+ * be handed to C without another copy. The xra_format functions write
+ * the slots of an interpolated string straight into the buffer it sized.
+ */
+
+namespace xra {
+
+namespace {
+
+char* Allocate(int64_t length)
+{
+  auto data = static_cast<char*>(xra_alloc(length + 1));
+  data[length] = '\0';
+  return data;
+}
+
+// "%g" needs no more than 13 characters for a double
+const size_t MaxFloatWidth = 24;
+
+} // namespace
+
+} // namespace xra
+
+char* xra_string_concat(const char* left, int64_t leftLength, const char* right, int64_t rightLength)
+{
+  if(rightLength == 0)
+    return const_cast<char*>(left);
+  if(leftLength == 0)
+    return const_cast<char*>(right);
+
+  auto data = xra::Allocate(leftLength + rightLength);
+  memcpy(data, left, size_t(leftLength));
+  memcpy(data + leftLength, right, size_t(rightLength));
+  return data;
+}
+
+int32_t xra_string_compare(const char* left, int64_t leftLength, const char* right, int64_t rightLength)
+{
+  auto length = leftLength < rightLength ? leftLength : rightLength;
+  if(int compare = memcmp(left, right, size_t(length)))
+    return compare < 0 ? -1 : 1;
+  return leftLength < rightLength ? -1 : leftLength > rightLength;
+}
+
+char* xra_string_cstr(const char* data, int64_t length)
+{
+  if(data[length] == '\0')
+    return const_cast<char*>(data);
+
+  auto copy = xra::Allocate(length);
+  memcpy(copy, data, size_t(length));
+  return copy;
+}
+
+int64_t xra_format_uint(char* out, uint64_t value)
+{
+  char digits[20];
+  size_t count = 0;
+  do {
+    digits[count++] = char('0' + value % 10);
+    value /= 10;
+  } while(value);
+
+  for(size_t i = 0; i < count; i++)
+    out[i] = digits[count - 1 - i];
+  return int64_t(count);
+}
+
+int64_t xra_format_int(char* out, int64_t value)
+{
+  if(value >= 0)
+    return xra_format_uint(out, uint64_t(value));
+
+  // negated unsigned, so the most negative value has a magnitude too
+  out[0] = '-';
+  return 1 + xra_format_uint(out + 1, 0 - uint64_t(value));
+}
+
+int64_t xra_format_float(char* out, double value)
+{
+  // snprintf always terminates, so format into a copy with room for the NUL
+  char text[xra::MaxFloatWidth + 1];
+  int length = snprintf(text, sizeof(text), "%g", value);
+  if(length < 0)
+    return 0;
+
+  auto count = size_t(length) < xra::MaxFloatWidth ? size_t(length) : xra::MaxFloatWidth;
+  memcpy(out, text, count);
+  return int64_t(count);
+}
@@ -0,0 +1,45 @@
+#ifndef XRA_RUNTIME_HPP
+#define XRA_RUNTIME_HPP
+
+#include <cstdint>
+
+/*
+ * Functions compiled code calls. They are linked into the compiler for the
+ * JIT and archived into libxra-runtime.a for the executables it links, so
+ * they depend on nothing but the C++ standard library.
+ */
+
+extern "C" {
+
+// runs body(context, chunk) once for every chunk in [0, chunks), spread
+// over the thread pool; returns once all of them have finished
+void xra_parallel_for(int64_t chunks, void (*body)(void*, int64_t), void* context);
+
+// enters a region on the calling thread; heap values xra_alloc makes until
+// the matching pop are freed by it all at once
+void xra_region_push();
+void xra_region_pop();
+
+// allocates from the thread's innermost region, or with malloc outside one
+void* xra_alloc(int64_t size);
+
+// the data of a new string holding left followed by right, which is one of
+// them if the other is empty
+char* xra_string_concat(const char* left, int64_t leftLength, const char* right, int64_t rightLength);
+
+// -1, 0 or 1 as left sorts before, equal to or after right
+int32_t xra_string_compare(const char* left, int64_t leftLength, const char* right, int64_t rightLength);
+
+// the string as a NUL-terminated C string, copied only if it is a slice
+// that does not end where its data does
+char* xra_string_cstr(const char* data, int64_t length);
+
+// write the decimal form of value at out and return its length; a float
+// takes at most 24 characters, and nothing is NUL-terminated
+int64_t xra_format_int(char* out, int64_t value);
+int64_t xra_format_uint(char* out, uint64_t value);
+int64_t xra_format_float(char* out, double value);
+
+}
+
+#endif // XRA_RUNTIME_HPP
@@ -0,0 +1,177 @@
+#include "common.hpp"
+#include "backend.hpp"
+#include <llvm/Instructions.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+namespace xra {
+
+/*
+ * Specialization: a direct call that passes constants for some parameters
+ * is redirected to a clone of its callee with those parameters replaced by
+ * the constants, so the optimizer can fold whatever depends on them. Only
+ * integer and float constants count; a null environment or other pointer
+ * gives the optimizer little to fold. Call patterns are cloned most frequent
+ * first, ties in the order they appear in the module, each exactly once,
+ * until the budget of cloned instructions runs out.
+ */
+
+// larger functions are never cloned
+static const size_t MaxSpecializedSize = 200;
+
+namespace {
+
+// the bits of an integer or float constant
+static llvm::APInt ConstantBits(const llvm::Constant* constant)
+{
+  if(auto fp = dyn_cast<llvm::ConstantFP>(constant))
+    return fp->getValueAPF().bitcastToAPInt();
+  return llvm::cast<llvm::ConstantInt>(constant)->getValue();
+}
+
+// which arguments of a call to which function are constants, and their values
+struct Pattern
+{
+  llvm::Function* callee;
+  vector<pair<unsigned int, llvm::Constant*>> constants;
+
+  // constants are compared by value, not address; the same argument of the
+  // same callee always has the same type
+  bool operator<(const Pattern& other) const
+  {
+    if(callee != other.callee)
+      return callee < other.callee;
+
+    for(size_t i = 0; i < constants.size() && i < other.constants.size(); i++) {
+      if(constants[i].first != other.constants[i].first)
+        return constants[i].first < other.constants[i].first;
+
+      auto bits = ConstantBits(constants[i].second);
+      auto otherBits = ConstantBits(other.constants[i].second);
+      if(bits.getBitWidth() != otherBits.getBitWidth())
+        return bits.getBitWidth() < otherBits.getBitWidth();
+      if(bits != otherBits)
+        return bits.ult(otherBits);
+    }
+    return constants.size() < other.constants.size();
+  }
+};
+
+} // namespace
+
+static bool GetPattern(llvm::CallInst& call, Pattern& pattern)
+{
+  auto callee = call.getCalledFunction();
+  if(!callee || callee->isDeclaration() || callee->isVarArg() || callee->mayBeOverridden())
+    return false;
+
+  pattern.callee = callee;
+  pattern.constants.clear();
+  for(unsigned int i = 0; i < call.getNumArgOperands(); i++) {
+    auto arg = call.getArgOperand(i);
+    if(isa<llvm::ConstantInt>(arg) || isa<llvm::ConstantFP>(arg))
+      pattern.constants.push_back({i, llvm::cast<llvm::Constant>(arg)});
+  }
+  return !pattern.constants.empty();
+}
+
+static size_t CountInstructions(llvm::Function& func)
+{
+  size_t count = 0;
+  for(auto& block : func)
+    count += block.size();
+  return count;
+}
+
+static llvm::Function* CreateSpecialization(llvm::Module& module, const Pattern& pattern)
+{
+  auto callee = pattern.callee;
+
+  vector<llvm::Argument*> params;
+  for(auto& param : callee->getArgumentList())
+    params.push_back(&param);
+
+  // parameters mapped to values are dropped from the clone's signature
+  llvm::ValueToValueMapTy map;
+  for(auto& constant : pattern.constants)
+    map[params[constant.first]] = constant.second;
+
+  auto clone = llvm::CloneFunction(callee, map, false);
+  clone->setName(callee->getName() + ".spec");
+  clone->setLinkage(llvm::GlobalValue::InternalLinkage);
+  clone->setCallingConv(callee->getCallingConv());
+  module.getFunctionList().push_back(clone);
+  return clone;
+}
+
+void Specialize(llvm::Module& module, size_t budget)
+{
+  // patterns in the order they first appear, so ties break the same way in every run
+  map<Pattern, size_t> counts;
+  vector<Pattern> patterns;
+  for(auto& func : module) {
+    for(auto& block : func) {
+      for(auto& inst : block) {
+        Pattern pattern;
+        if(isa<llvm::CallInst>(&inst) && GetPattern(static_cast<llvm::CallInst&>(inst), pattern)) {
+          if(counts[pattern]++ == 0)
+            patterns.push_back(pattern);
+        }
+      }
+    }
+  }
+
+  vector<pair<Pattern, size_t>> candidates;
+  for(auto& pattern : patterns)
+    candidates.push_back({pattern, counts[pattern]});
+  stable_sort(candidates.begin(), candidates.end(), [](const pair<Pattern, size_t>& a, const pair<Pattern, size_t>& b) {
+    return a.second > b.second;
+  });
+
+  map<Pattern, llvm::Function*> clones;
+  for(auto& candidate : candidates) {
+    size_t size = CountInstructions(*candidate.first.callee);
+    if(size > MaxSpecializedSize || size > budget)
+      continue;
+
+    budget -= size;
+    clones[candidate.first] = CreateSpecialization(module, candidate.first);
+  }
+
+  if(clones.empty())
+    return;
+
+  for(auto& func : module) {
+    for(auto& block : func) {
+      for(auto it = block.begin(); it != block.end();) {
+        auto call = dyn_cast<llvm::CallInst>(&*it++);
+
+        Pattern pattern;
+        if(!call || !GetPattern(*call, pattern))
+          continue;
+
+        auto clone = clones.find(pattern);
+        if(clone == clones.end())
+          continue;
+
+        vector<llvm::Value*> args;
+        auto constant = pattern.constants.begin();
+        for(unsigned int i = 0; i < call->getNumArgOperands(); i++) {
+          if(constant != pattern.constants.end() && constant->first == i)
+            ++constant;
+          else
+            args.push_back(call->getArgOperand(i));
+        }
+
+        auto replacement = llvm::CallInst::Create(clone->second, args, "", call);
+        replacement->setCallingConv(call->getCallingConv());
+        replacement->setTailCall(call->isTailCall());
+        replacement->setDebugLoc(call->getDebugLoc());
+        replacement->takeName(call);
+        call->replaceAllUsesWith(replacement);
+        call->eraseFromParent();
+      }
+    }
+  }
+}
+
+} // namespace xra
@@ -0,0 +1,288 @@
+#include "common.hpp"
+#include "backend.hpp"
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+
+namespace xra {
+
+/*
+ * Tiered execution: the module is JITed at -O0, with a counter per function
+ * that is bumped on entry and on every loop backedge. A function crossing
+ * the threshold is queued for the worker thread, which compiles it at -O3
+ * in a separate context and engine built from a bitcode snapshot taken
+ * before instrumentation. Direct calls go through a per-function slot, so
+ * installing the optimized code is a single atomic pointer store; running
+ * activations finish in the baseline code. Calls through a closure jump to
+ * the code pointer stored in it and stay in the baseline tier.
+ */
+
+static Tiering* active = nullptr;
+
+// counter += 1 (atomically); if(counter >= threshold && !fired) { fired = 1; hook(id) }; br next
+// racing threads may both call the hook, which ignores functions already queued
+static void EmitCount(llvm::BasicBlock* block, llvm::BasicBlock* next, llvm::GlobalVariable* counter,
+                      llvm::GlobalVariable* fired, llvm::Function* hook, int32_t id, unsigned int threshold)
+{
+  auto& context = block->getContext();
+  auto int8Type = llvm::Type::getInt8Ty(context);
+  auto int32Type = llvm::Type::getInt32Ty(context);
+  auto hotBlock = llvm::BasicBlock::Create(context, "tierhot", block->getParent(), next);
+  auto fireBlock = llvm::BasicBlock::Create(context, "tierfire", block->getParent(), next);
+
+  llvm::IRBuilder<> builder(block);
+  auto one = llvm::ConstantInt::get(int32Type, 1);
+  auto previous = builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter, one, llvm::Monotonic);
+  auto count = builder.CreateAdd(previous, one);
+  auto isHot = builder.CreateICmpUGE(count, llvm::ConstantInt::get(int32Type, threshold));
+  builder.CreateCondBr(isHot, hotBlock, next);
+
+  builder.SetInsertPoint(hotBlock);
+  auto wasFired = builder.CreateLoad(fired);
+  wasFired->setAtomic(llvm::Monotonic);
+  wasFired->setAlignment(1);
+  builder.CreateCondBr(builder.CreateICmpEQ(wasFired, llvm::ConstantInt::get(int8Type, 0)), fireBlock, next);
+
+  builder.SetInsertPoint(fireBlock);
+  auto setFired = builder.CreateStore(llvm::ConstantInt::get(int8Type, 1), fired);
+  setFired->setAtomic(llvm::Monotonic);
+  setFired->setAlignment(1);
+  builder.CreateCall(hook, llvm::ConstantInt::get(int32Type, id));
+  builder.CreateBr(next);
+}
+
+static void InstrumentFunction(llvm::Function& func, llvm::GlobalVariable* counter, llvm::GlobalVariable* fired,
+                               llvm::Function* hook, int32_t id, unsigned int threshold)
+{
+  auto& context = func.getContext();
+
+  // count loop iterations on a block of their own on each backedge
+  llvm::SmallVector<pair<const llvm::BasicBlock*, const llvm::BasicBlock*>, 8> backedges;
+  llvm::FindFunctionBackedges(func, backedges);
+
+  for(auto& backedge : backedges) {
+    auto from = const_cast<llvm::BasicBlock*>(backedge.first);
+    auto to = const_cast<llvm::BasicBlock*>(backedge.second);
+    auto countBlock = llvm::BasicBlock::Create(context, "tierloop", &func, to);
+
+    auto terminator = from->getTerminator();
+    for(unsigned int i = 0; i < terminator->getNumSuccessors(); ++i) {
+      if(terminator->getSuccessor(i) == to)
+        terminator->setSuccessor(i, countBlock);
+    }
+    for(auto it = to->begin(); auto phi = llvm::dyn_cast<llvm::PHINode>(it); ++it) {
+      for(unsigned int i = 0; i < phi->getNumIncomingValues(); ++i) {
+        if(phi->getIncomingBlock(i) == from)
+          phi->setIncomingBlock(i, countBlock);
+      }
+    }
+
+    EmitCount(countBlock, to, counter, fired, hook, id, threshold);
+  }
+
+  // count calls after the allocas, which stay at the top of the entry block
+  auto entry = &func.getEntryBlock();
+  auto it = entry->begin();
+  while(isa<llvm::AllocaInst>(it))
+    ++it;
+
+  auto body = entry->splitBasicBlock(it, "tierentry");
+  entry->getTerminator()->eraseFromParent();
+  EmitCount(entry, body, counter, fired, hook, id, threshold);
+}
+
+Tiering::Tiering(llvm::Module& module, llvm::Function& entry, const BackendOptions& options_) :
+  options(options_),
+  optimizedModule(nullptr),
+  stopping(false)
+{
+  // the optimizing tier starts from the uninstrumented module
+  llvm::raw_string_ostream os(bitcode);
+  llvm::WriteBitcodeToFile(&module, os);
+  os.flush();
+
+  auto& context = module.getContext();
+  auto int8Type = llvm::Type::getInt8Ty(context);
+  auto int32Type = llvm::Type::getInt32Ty(context);
+
+  vector<llvm::Type*> hookParams{int32Type};
+  hook = llvm::Function::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(context), hookParams, false),
+                                llvm::Function::ExternalLinkage, "xra.tier.hot", &module);
+
+  // mutable globals are shared with the optimized code instead of copied;
+  // the optimized module lists them in the same order
+  for(auto& global : module.getGlobalList()) {
+    if(!global.isDeclaration() && !global.isConstant())
+      sharedGlobals.push_back(&global);
+  }
+
+  vector<llvm::Function*> candidates;
+  for(auto& func : module) {
+    if(!func.isDeclaration() && &func != &entry)
+      candidates.push_back(&func);
+  }
+
+  for(auto func : candidates) {
+    int32_t id = (int32_t)functions.size();
+
+    auto counter = new llvm::GlobalVariable(module, int32Type, false, llvm::GlobalValue::InternalLinkage,
+                                            llvm::ConstantInt::get(int32Type, 0), "xra.tier.count");
+    auto fired = new llvm::GlobalVariable(module, int8Type, false, llvm::GlobalValue::InternalLinkage,
+                                          llvm::ConstantInt::get(int8Type, 0), "xra.tier.fired");
+    auto slot = new llvm::GlobalVariable(module, func->getType(), false, llvm::GlobalValue::InternalLinkage,
+                                         func, "xra.tier.slot");
+    functions.push_back({func->getName().str(), slot, nullptr, false});
+
+    InstrumentFunction(*func, counter, fired, hook, id, options.tierThreshold);
+
+    // route direct calls through the slot
+    vector<llvm::CallInst*> calls;
+    for(auto use = func->use_begin(); use != func->use_end(); ++use) {
+      auto call = llvm::dyn_cast<llvm::CallInst>(*use);
+      if(call && call->getCalledFunction() == func)
+        calls.push_back(call);
+    }
+
+    for(auto call : calls) {
+      llvm::IRBuilder<> builder(call);
+      auto target = builder.CreateLoad(slot, func->getName() + ".tier");
+      target->setAtomic(llvm::Acquire);
+      target->setAlignment(sizeof(void*));
+      call->setCalledFunction(target);
+    }
+  }
+}
+
+Tiering::~Tiering()
+{
+  {
+    lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeup.notify_one();
+
+  if(worker.joinable())
+    worker.join();
+
+  if(active == this)
+    active = nullptr;
+}
+
+void Tiering::Start(llvm::ExecutionEngine& engine)
+{
+  llvm::llvm_start_multithreaded();
+
+  engine.addGlobalMapping(hook, (void*)&Tiering::Hot);
+  for(auto& function : functions)
+    function.slotAddress = (void**)engine.getPointerToGlobal(function.slot);
+  for(auto global : sharedGlobals)
+    sharedAddresses.push_back(engine.getPointerToGlobal(global));
+
+  active = this;
+  worker = std::thread(&Tiering::Run, this);
+}
+
+void Tiering::Hot(int32_t id)
+{
+  auto self = active;
+  if(!self)
+    return;
+
+  lock_guard<std::mutex> lock(self->mutex);
+  auto& function = self->functions[id];
+  if(function.queued)
+    return;
+
+  function.queued = true;
+  self->queue.push_back(id);
+  self->wakeup.notify_one();
+}
+
+void Tiering::Run()
+{
+  for(;;) {
+    int32_t id;
+    {
+      unique_lock<std::mutex> lock(mutex);
+      wakeup.wait(lock, [this] { return stopping || !queue.empty(); });
+      if(stopping)
+        return;
+
+      id = queue.front();
+      queue.pop_front();
+    }
+
+    Recompile(functions[id]);
+  }
+}
+
+bool Tiering::CreateOptimizedEngine()
+{
+  optimizedContext = make_unique<llvm::LLVMContext>();
+
+  string err;
+  unique_ptr<llvm::MemoryBuffer> buffer(llvm::MemoryBuffer::getMemBuffer(bitcode, "", false));
+  optimizedModule = llvm::ParseBitcodeFile(buffer.get(), *optimizedContext, &err);
+  if(!optimizedModule)
+    return false;
+
+  // keep every function's name and signature intact so its code can be
+  // installed into the baseline slot
+  for(auto& func : *optimizedModule) {
+    if(!func.isDeclaration())
+      func.setLinkage(llvm::Function::ExternalLinkage);
+  }
+
+  // the shared globals are matched by position, since they need not have
+  // names, and named here to find the ones that survive optimization
+  vector<string> sharedNames;
+  for(auto& global : optimizedModule->getGlobalList()) {
+    if(global.isDeclaration() || global.isConstant())
+      continue;
+    global.setName("xra.tier.shared");
+    global.setInitializer(nullptr);
+    global.setLinkage(llvm::GlobalValue::ExternalLinkage);
+    sharedNames.push_back(global.getName().str());
+  }
+  if(sharedNames.size() != sharedAddresses.size()) {
+    delete optimizedModule;
+    optimizedModule = nullptr;
+    return false;
+  }
+
+  BackendOptions optimizedOptions = options;
+  optimizedOptions.optLevel = 3;
+  optimizedOptions.lazyJIT = false;
+  Optimize(*optimizedModule, optimizedOptions);
+
+  optimizedEngine = CreateJIT(optimizedModule, optimizedOptions, err);
+  if(!optimizedEngine) {
+    delete optimizedModule;
+    optimizedModule = nullptr;
+    return false;
+  }
+
+  for(size_t i = 0; i < sharedNames.size(); i++) {
+    if(auto global = optimizedModule->getGlobalVariable(sharedNames[i], true))
+      optimizedEngine->addGlobalMapping(global, sharedAddresses[i]);
+  }
+
+  return true;
+}
+
+void Tiering::Recompile(Function& function)
+{
+  // a failed engine is not retried; everything stays at the baseline tier
+  if(!optimizedModule && (optimizedContext || !CreateOptimizedEngine()))
+    return;
+
+  auto func = optimizedModule->getFunction(function.name);
+  if(!func || func->isDeclaration())
+    return;
+
+  void* code = optimizedEngine->getPointerToFunction(func);
+  if(code)
+    __atomic_store_n(function.slotAddress, code, __ATOMIC_RELEASE);
+}
+
+} // namespace xra
@@ -3,6 +3,22 @@
 
 namespace xra {
 
+// tuple parameters are passed as their scalar fields
+static void FlattenParam(llvm::Type* type, vector<llvm::Type*>& params)
+{
+  if(type->isVoidTy())
+    return;
+
+  auto structType = dyn_cast<llvm::StructType>(type);
+  if(!structType) {
+    params.push_back(type);
+    return;
+  }
+
+  for(unsigned int i = 0; i < structType->getNumElements(); i++)
+    FlattenParam(structType->getElementType(i), params);
+}
+
 struct TypeToLLVMVisitor : Visitor<TypeToLLVMVisitor, const Type>
 {
   llvm::LLVMContext& ctx;
@@ -37,9 +53,12 @@ struct TypeToLLVMVisitor : Visitor<TypeToLLVMVisitor, const Type>
       result = llvm::Type::getFP128Ty(ctx);
   }
 
+  // strings are {data, length}; the data is followed by a NUL, so unless
+  // it is a slice it can be handed to C as is
   void VisitTString(const TString&)
   {
-    result = llvm::Type::getInt8PtrTy(ctx);
+    vector<llvm::Type*> fields{llvm::Type::getInt8PtrTy(ctx), llvm::Type::getInt64Ty(ctx)};
+    result = llvm::StructType::get(ctx, fields, false);
   }
 
   void VisitTList(const TList& type)
@@ -57,19 +76,13 @@ struct TypeToLLVMVisitor : Visitor<TypeToLLVMVisitor, const Type>
     result = llvm::StructType::get(ctx, llvmTypes, false);
   }
 
+  // function values are closures: {code, env}
   void VisitTFunction(const TFunction& type)
   {
-    vector<llvm::Type*> llvmParams;
-    for(auto& f : static_cast<TList&>(*type.parameter).fields) {
-      Visit(f.type.get());
-      llvmParams.push_back(result);
-    }
-
-    Visit(type.result.get());
-    auto llvmResult = result;
-
-    result = llvm::FunctionType::get(llvmResult, llvmParams, false);
-    result = result->getPointerTo();
+    vector<llvm::Type*> fields;
+    fields.push_back(ToLLVMFunction(type, ctx, true)->getPointerTo());
+    fields.push_back(llvm::Type::getInt8PtrTy(ctx));
+    result = llvm::StructType::get(ctx, fields, false);
   }
 };
 
@@ -80,4 +93,35 @@ llvm::Type* ToLLVM(const Type& type, llvm::LLVMContext& ctx)
   return visitor.result;
 }
 
+llvm::FunctionType* ToLLVMFunction(const Type& type, llvm::LLVMContext& ctx, bool env)
+{
+  auto& funcType = static_cast<const TFunction&>(type);
+
+  vector<llvm::Type*> params;
+  for(auto& f : static_cast<TList&>(*funcType.parameter).fields)
+    FlattenParam(ToLLVM(*f.type, ctx), params);
+  if(env)
+    params.push_back(llvm::Type::getInt8PtrTy(ctx));
+
+  return llvm::FunctionType::get(ToLLVM(*funcType.result, ctx), params, false);
+}
+
+// strings cross into C as char pointers
+static llvm::Type* ToC(const Type& type, llvm::LLVMContext& ctx)
+{
+  return isa<TString>(&type) ? llvm::Type::getInt8PtrTy(ctx) : ToLLVM(type, ctx);
+}
+
+// the C signature of an extern function
+llvm::FunctionType* ToLLVMExtern(const Type& type, llvm::LLVMContext& ctx)
+{
+  auto& funcType = static_cast<const TFunction&>(type);
+
+  vector<llvm::Type*> params;
+  for(auto& f : static_cast<TList&>(*funcType.parameter).fields)
+    FlattenParam(ToC(*f.type, ctx), params);
+
+  return llvm::FunctionType::get(ToC(*funcType.result, ctx), params, false);
+}
+
 } // namespace xra
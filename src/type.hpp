@@ -46,6 +46,8 @@ void GetVariables(const Type&, set<string>&);
 
 // type-tollvm.cpp
 llvm::Type* ToLLVM(const Type&, llvm::LLVMContext&);
+llvm::FunctionType* ToLLVMFunction(const Type&, llvm::LLVMContext&, bool env);
+llvm::FunctionType* ToLLVMExtern(const Type&, llvm::LLVMContext&);
 
 /*
  * Subtypes
@@ -6,8 +6,24 @@ namespace xra {
 void TypeChecker::VisitEVariable(EVariable& expr)
 {
   expr.value = env[expr.name];
-  if(!expr.value)
-    Error() << "unbound variable " << expr.name;
+  if(!expr.value) {
+    Error(expr.loc) << "unbound variable " << expr.name;
+    return;
+  }
+
+  // a local of an enclosing function is captured by every function in between
+  auto local = dyn_cast<VLocal>(expr.value.get());
+  if(!local)
+    return;
+
+  for(auto it = functions.rbegin(); it != functions.rend() && *it != local->owner; ++it) {
+    auto& captures = (*it)->captures;
+    auto found = find_if(captures.begin(), captures.end(), [&](const EFunction::Capture& capture) {
+      return capture.name == expr.name;
+    });
+    if(found == captures.end())
+      captures.push_back({expr.name, local});
+  }
 }
 
 void TypeChecker::VisitEBoolean(EBoolean& expr)
@@ -51,7 +67,7 @@ void TypeChecker::VisitEFunction(EFunction& expr)
   // TypeEnv env' = remove env n
   // env'' = TypeEnv (env' `Map.union` (Map.singleton n (Scheme [] tv)))
   for(auto& f : fields) {
-    ValuePtr value = new VLocal;
+    ValuePtr value = new VLocal(&expr, true);
     value->type = f.type;
     env.AddValue(f.name, value);
   }
@@ -60,9 +76,11 @@ void TypeChecker::VisitEFunction(EFunction& expr)
   TypePtr lastReturnType = returnType;
   returnType = nullptr;
   bool lastInsideLoop = insideLoop;
-  insideLoop = false;
+  insideLoop = expr.loopBody;
 
+  functions.push_back(&expr);
   Visit(expr.body.get());
+  functions.pop_back();
   if(!expr.body->value)
     return;
 
@@ -72,14 +90,40 @@ void TypeChecker::VisitEFunction(EFunction& expr)
   returnType = lastReturnType;
   insideLoop = lastInsideLoop;
 
+  // parameters the body determined, like a generator's consumer
+  for(auto& f : fields)
+    f.type = Apply(subst, *f.type);
+
   // return (s1, TFun(apply s1 tv) t1)
   // MODIFIED (apply s1 tv) removed, unneeded
   expr.value = new VTemporary;
   expr.value->type = new TFunction(expr.param, expr.body->value->type);
 }
 
+// the body of a for over a generator needs the type of its loop variable
+// before it is checked, and only the generator's type has it
+static void BindLoopVariable(const Type& calleeType, Expr& argument)
+{
+  auto args = dyn_cast<EList>(&argument);
+  auto consumer = args && !args->exprs.empty() ? dyn_cast<EFunction>(args->exprs.back().get()) : nullptr;
+  auto callee = dyn_cast<TFunction>(&calleeType);
+  if(!consumer || !consumer->loopBody || !callee)
+    return;
+
+  auto params = dyn_cast<TList>(callee->parameter.get());
+  auto consumerType = params && !params->fields.empty() ? dyn_cast<TFunction>(params->fields.back().type.get()) : nullptr;
+  auto yielded = consumerType ? dyn_cast<TList>(consumerType->parameter.get()) : nullptr;
+  if(yielded && yielded->fields.size() == 1)
+    static_cast<TList&>(*consumer->param).fields[0].type = yielded->fields[0].type;
+}
+
 void TypeChecker::VisitECall(ECall& expr)
 {
+  // past the error limit nothing more is inferred, so every caller unwinds
+  if(Diagnostics::Current().Aborted())
+    return;
+  Diagnostics::Context context(expr.loc);
+
   // (s1, t1) <- ti env e1
   Visit(expr.function.get());
 
@@ -104,10 +148,13 @@ void TypeChecker::VisitECall(ECall& expr)
     expr.value->type = MakeTypeVar();
 
     // (s2, t2) <- ti (apply s1 env) e2
+    BindLoopVariable(*expr.function->value->type, *expr.argument);
     Visit(expr.argument.get());
 
-    if(!expr.argument->value)
+    if(!expr.argument->value) {
+      expr.value = nullptr;
       return;
+    }
 
     TypeSubst argumentSubst;
     subst.swap(argumentSubst);
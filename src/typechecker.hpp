@@ -19,6 +19,7 @@ public:
   bool insideLoop;
   string moduleName;
   set<string> usingModules;
+  vector<EFunction*> functions; // enclosing functions, innermost last
 
   void VisitEVariable(EVariable&);
   void VisitEBoolean(EBoolean&);
@@ -5,6 +5,8 @@
 
 namespace xra {
 
+class EFunction;
+
 /*
  * Base value
  */
@@ -41,6 +43,14 @@ public:
 
   virtual ValuePtr Infer(TypeChecker&, const vector<ExprPtr>&) = 0;
   virtual void Compile(Compiler&, const vector<ExprPtr>&) = 0;
+
+  // whether the call can be evaluated even when its result is not needed:
+  // no side effects, cannot trap, and costs at most budget operations
+  virtual bool CanSpeculate(const vector<ExprPtr>&, int& /*budget*/) { return false; }
+
+  // whether the builtin has no effects beyond computing its result and
+  // assigning locals of the function it runs in
+  virtual bool IsPure() const { return false; }
 };
 
 class VTemporary : public Value
@@ -66,11 +76,20 @@ public:
 class VLocal : public Value
 {
 public:
-  VLocal() :
-    Value(Kind_VLocal)
+  VLocal(EFunction* owner_, bool param_ = false) :
+    Value(Kind_VLocal),
+    owner(owner_),
+    param(param_),
+    assignedOnce(false),
+    function(nullptr)
   {}
 
   CLASSOF(VLocal)
+
+  EFunction* owner; // the function whose frame holds the local
+  bool param;
+  bool assignedOnce; // set by AnalyzeClosures
+  EFunction* function; // set by AnalyzeClosures if only ever assigned this function
 };
 
 class VExtern : public Value
@@ -1,22 +1,56 @@
 #!/usr/bin/perl
 use strict;
 use warnings;
+use File::Temp qw(tempdir);
 
 my $filePath = shift or die "Usage: $0 <path>";
 
 my %opt;
 $opt{expect} = 'success';
+$opt{runs} = 1;
 
 open(my $fh, $filePath) or die "Failed to open $filePath: $!";
 while(<$fh>) {
-  $opt{$1} = $2 if(/##\s*(\S+)\s*=\s*(\S+)\s*$/);
+  $opt{$1} = $2 if(/##\s*(\S+)\s*=\s*(.*?)\s*$/);
 }
 close($fh);
 
+# "%t" in arguments names a scratch directory private to this test
+my $tempDir = tempdir(CLEANUP => 1);
+s/%t/$tempDir/g for values %opt;
+
 my @args;
 push @args, "src/xra";
-push @args, $opt{args} if $opt{args};
+push @args, split(' ', $opt{args}) if $opt{args};
 push @args, $filePath;
 
-my $code = system(@args);
-die "Failed to run script: $filePath" if(($code == 0) != ($opt{expect} eq 'success'));
+sub run {
+  # "## stderr = merge" compares diagnostics along with the output
+  my $pid = open(my $out, '-|') // die "Failed to fork: $!";
+  if($pid == 0) {
+    open(STDERR, '>&', \*STDOUT) or die "Failed to redirect stderr: $!" if(($opt{stderr} // '') eq 'merge');
+    exec(@_) or die "Failed to run $_[0]: $!";
+  }
+  # "## match = REGEX" prints only the matching parts of the output, one per line
+  while(<$out>) {
+    if(defined $opt{match}) {
+      print "$&\n" while(/$opt{match}/g);
+    }
+    else {
+      print;
+    }
+  }
+  close($out);
+  return $? == 0;
+}
+
+# "## runs = N" runs the compiler N times, e.g. to see state left by earlier runs
+for(1 .. $opt{runs}) {
+  my $ok = run(@args);
+  die "Failed to run script: $filePath" if($ok != ($opt{expect} eq 'success'));
+}
+
+# "## exec = COMMAND" then runs a shell command, e.g. what the compiler built
+if(defined $opt{exec}) {
+  run($opt{exec}) or die "Failed to run $opt{exec} built from $filePath";
+}